@@ -0,0 +1,59 @@
+#ifndef PBT_ALIAS_TABLE_H
+#define PBT_ALIAS_TABLE_H
+
+#include <random>
+#include <vector>
+
+/* Vose's alias method: after an O(n) setup, picks an index with probability
+   proportional to its weight in O(1) (one uniform index + one coin flip).
+
+   AliasTable({1,3}).sample(rng) --> 0 (25% of the time)
+                                 --> 1 (75% of the time)
+
+   Expects at least one positive weight.
+ */
+class AliasTable {
+public:
+    explicit AliasTable(const std::vector<unsigned int> &weights) {
+        size_t n = weights.size();
+        prob.resize(n);
+        alias.resize(n);
+
+        double total = 0;
+        for (auto w: weights) { total += w; }
+
+        // Scale so that the average weight is 1; then pair up under- and overfull columns.
+        std::vector<double> scaled(n);
+        std::vector<size_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            scaled[i] = weights[i] * (double) n / total;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            size_t s = small.back(); small.pop_back();
+            size_t l = large.back(); large.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+            (scaled[l] < 1.0 ? small : large).push_back(l);
+        }
+        // Whatever is left is full (up to floating point error)
+        for (auto i: large) { prob[i] = 1.0; alias[i] = i; }
+        for (auto i: small) { prob[i] = 1.0; alias[i] = i; }
+    }
+
+    [[nodiscard]] size_t size() const { return prob.size(); }
+
+    size_t sample(std::mt19937 &rng) const {
+        std::uniform_int_distribution<size_t> column(0, prob.size() - 1);
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        size_t i = column(rng);
+        return coin(rng) < prob[i] ? i : alias[i];
+    }
+
+private:
+    std::vector<double> prob;
+    std::vector<size_t> alias;
+};
+
+#endif//PBT_ALIAS_TABLE_H
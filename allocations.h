@@ -0,0 +1,223 @@
+#ifndef PBT_ALLOCATIONS_H
+#define PBT_ALLOCATIONS_H
+
+#include "scoped_current.h"
+#include "test_exception.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Per-test-call allocation tracking.
+
+   Including this header replaces the global operator new/delete (so include
+   it in one translation unit only). Allocations are only counted inside an
+   AllocationScope; outside of one they cost a thread_local read.
+
+   Only the plain (not over-aligned) operator new/delete are tracked.
+ */
+
+struct AllocationStats {
+    uint64_t allocations = 0;
+    uint64_t total_bytes = 0;// allocated in the scope, even if freed since
+    int64_t live_bytes = 0;  // allocated minus freed; negative if the scope freed memory from outside of it
+    uint64_t peak_bytes = 0; // max of live_bytes
+};
+
+/* Counts the allocations made on this thread while it's alive:
+
+   {
+       AllocationScope scope;
+       Gen::unsigned_int(1000)(Live{RandomRun(), rng});
+       scope.stats().total_bytes --> 4 (the RandomRun's one choice)
+   }
+
+   Scopes nest; an allocation counts towards all the enclosing scopes.
+ */
+class AllocationScope {
+public:
+    AllocationScope() : parent(current) { current = this; }
+    ~AllocationScope() { current = parent; }
+    AllocationScope(const AllocationScope &) = delete;
+    AllocationScope &operator=(const AllocationScope &) = delete;
+
+    [[nodiscard]] const AllocationStats &stats() const { return counted; }
+
+    static void on_allocate(size_t size) {
+        for (AllocationScope *scope = current; scope; scope = scope->parent) {
+            scope->counted.allocations++;
+            scope->counted.total_bytes += size;
+            scope->counted.live_bytes += (int64_t) size;
+            if (scope->counted.live_bytes > (int64_t) scope->counted.peak_bytes) {
+                scope->counted.peak_bytes = scope->counted.live_bytes;
+            }
+        }
+    }
+
+    static void on_free(size_t size) {
+        for (AllocationScope *scope = current; scope; scope = scope->parent) {
+            scope->counted.live_bytes -= (int64_t) size;
+        }
+    }
+
+private:
+    AllocationStats counted;
+    AllocationScope *parent;
+
+    static thread_local inline AllocationScope *current = nullptr;
+};
+
+struct MemoryLimit {
+    uint64_t limit_bytes;
+    const AllocationScope *scope;
+    bool exceeded = false;// an allocation was refused for going over the limit
+};
+
+// The memory limit of the test call running on this thread, if any.
+thread_local MemoryLimit *current_memory_limit = nullptr;
+
+namespace pbt_allocations {
+
+// Every allocation is prefixed with its size, so that unsized delete knows how much got freed.
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+// Refuses (returns nullptr) allocations that would take the current memory limit's scope over the limit.
+inline void *allocate(size_t size) noexcept {
+    if (current_memory_limit &&
+        current_memory_limit->scope->stats().live_bytes + (int64_t) size > (int64_t) current_memory_limit->limit_bytes) {
+        current_memory_limit->exceeded = true;
+        return nullptr;
+    }
+    void *base = std::malloc(size + HEADER_SIZE);
+    if (!base) { return nullptr; }
+    *static_cast<size_t *>(base) = size;
+    AllocationScope::on_allocate(size);
+    return static_cast<char *>(base) + HEADER_SIZE;
+}
+
+inline void free(void *ptr) noexcept {
+    if (!ptr) { return; }
+    void *base = static_cast<char *>(ptr) - HEADER_SIZE;
+    AllocationScope::on_free(*static_cast<size_t *>(base));
+    std::free(base);
+}
+
+}// namespace pbt_allocations
+
+void *operator new(size_t size) {
+    void *ptr = pbt_allocations::allocate(size);
+    if (!ptr) { throw std::bad_alloc(); }
+    return ptr;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return pbt_allocations::allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return pbt_allocations::allocate(size); }
+void operator delete(void *ptr) noexcept { pbt_allocations::free(ptr); }
+void operator delete[](void *ptr) noexcept { pbt_allocations::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { pbt_allocations::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { pbt_allocations::free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { pbt_allocations::free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { pbt_allocations::free(ptr); }
+
+/* Thrown when a test call has more than the allowed number of bytes allocated
+   at once. The memory counterpart of TimeoutException (see deadline.h).
+ */
+class MemoryLimitException : public TestException {
+public:
+    explicit MemoryLimitException(uint64_t limit_bytes)
+        : TestException("Allocated more than " + std::to_string(limit_bytes) + " bytes") {}
+};
+
+// Like `check_deadline()`, for code under test that handles std::bad_alloc itself.
+void check_memory_limit() {
+    if (current_memory_limit && current_memory_limit->exceeded) {
+        throw MemoryLimitException(current_memory_limit->limit_bytes);
+    }
+}
+
+/* Like `with_deadline()`, but for calls that try to have more than
+   `limit_bytes` allocated at once:
+
+   run(generator, with_memory_limit(1 << 20, test_function));
+
+   Unlike deadlines, the limit is enforced right away: the allocation that
+   would go over it fails (operator new throws std::bad_alloc), so a runaway
+   test call stops there instead of running out of memory. The wrapper turns
+   that into a MemoryLimitException, as well as any call that got an
+   allocation refused but carried on anyway.
+ */
+template<typename FN>
+auto with_memory_limit(uint64_t limit_bytes, FN test_function) {
+    return [limit_bytes, test_function](auto &&value) mutable {
+        AllocationScope scope;
+        MemoryLimit limit{limit_bytes, &scope};
+        {
+            ScopedCurrent<MemoryLimit> guard(current_memory_limit, &limit);
+            try {
+                test_function(std::forward<decltype(value)>(value));
+            } catch (std::bad_alloc &) {
+                if (!limit.exceeded) { throw; }// a real out of memory, not our limit
+            }
+        }
+        // Outside of the guard: constructing the exception allocates too
+        if (limit.exceeded) {
+            throw MemoryLimitException(limit_bytes);
+        }
+    };
+}
+
+// What each test call of a `track_allocations`-wrapped test function allocated.
+struct AllocationReport {
+    std::vector<AllocationStats> calls;
+};
+
+/* Wraps a test function so that the allocations of each of its calls
+   (including the ones made while shrinking) get recorded into `report`:
+
+   AllocationReport report;
+   run(generator, track_allocations(report, test_function));
+   print_allocation_report(report);
+ */
+template<typename FN>
+auto track_allocations(AllocationReport &report, FN test_function) {
+    return [&report, test_function](auto &&value) mutable {
+        AllocationScope scope;
+        struct record_on_exit {
+            AllocationReport &report;
+            const AllocationScope &scope;
+            ~record_on_exit() {
+                AllocationStats stats = scope.stats();// before push_back allocates inside the scope
+                report.calls.push_back(stats);
+            }
+        };
+        record_on_exit recorder{report, scope};
+
+        test_function(std::forward<decltype(value)>(value));
+    };
+}
+
+void print_allocation_report(const AllocationReport &report) {
+    uint64_t max_peak = 0, max_total = 0, max_allocations = 0;
+    uint64_t sum_peak = 0, sum_total = 0, sum_allocations = 0;
+    for (const auto &call: report.calls) {
+        max_peak = std::max(max_peak, call.peak_bytes);
+        max_total = std::max(max_total, call.total_bytes);
+        max_allocations = std::max(max_allocations, call.allocations);
+        sum_peak += call.peak_bytes;
+        sum_total += call.total_bytes;
+        sum_allocations += call.allocations;
+    }
+    uint64_t n = report.calls.empty() ? 1 : report.calls.size();
+    std::cout << "Allocations over " << report.calls.size() << " test calls (max / mean):"
+              << "\n - peak bytes: " << max_peak << " / " << sum_peak / n
+              << "\n - total bytes: " << max_total << " / " << sum_total / n
+              << "\n - allocations: " << max_allocations << " / " << sum_allocations / n << std::endl;
+}
+
+#endif//PBT_ALLOCATIONS_H
@@ -0,0 +1,303 @@
+#ifndef PBT_ASYNC_H
+#define PBT_ASYNC_H
+
+#include "gen_result.h"
+#include "generator.h"
+#include "pbt.h"
+#include "rand_source.h"
+#include "random_run.h"
+#include "shrink.h"
+#include "test_exception.h"
+#include "test_result.h"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define ASYNC_TESTS_IN_FLIGHT 16
+
+/* The return type of async test functions (and of any coroutines they await).
+
+   [](unsigned int n) -> Task {
+       co_await sleep_for(std::chrono::milliseconds(5));
+       if (n > 500) { throw TestException("..."); }
+   }
+
+   Tasks start suspended; awaiting one runs it to completion and rethrows
+   whatever it threw.
+ */
+class Task {
+public:
+    struct promise_type {
+        std::exception_ptr exception;
+        std::coroutine_handle<> continuation;// whoever awaits us, if anybody
+
+        Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct resume_continuation {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    auto continuation = h.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return resume_continuation{};
+        }
+        void return_void() {}
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task &&rhs) noexcept : handle(std::exchange(rhs.handle, nullptr)) {}
+    Task &operator=(Task &&rhs) noexcept {
+        if (this != &rhs) {
+            if (handle) { handle.destroy(); }
+            handle = std::exchange(rhs.handle, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (handle) { handle.destroy(); }
+    }
+
+    [[nodiscard]] bool is_done() const { return handle.done(); }
+    std::coroutine_handle<> coroutine() const { return handle; }
+    void rethrow_if_failed() const {
+        if (handle.promise().exception) { std::rethrow_exception(handle.promise().exception); }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    void await_resume() const { rethrow_if_failed(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* A single-threaded event loop: runs coroutines that are ready, and otherwise
+   sleeps in poll() until a timer fires or a file descriptor becomes ready.
+ */
+class EventLoop {
+public:
+    void schedule(std::coroutine_handle<> h) { ready.push_back(h); }
+
+    void wake_at(std::chrono::steady_clock::time_point at, std::coroutine_handle<> h) { timers.emplace(at, h); }
+
+    void wake_on(int fd, short events, std::coroutine_handle<> h) { io.push_back(IoWait{fd, events, h}); }
+
+    [[nodiscard]] bool is_idle() const { return ready.empty() && timers.empty() && io.empty(); }
+
+    /* Forgets all the suspended coroutines. Their owners (Tasks) are then free
+       to destroy them. */
+    void clear() {
+        ready.clear();
+        timers.clear();
+        io.clear();
+    }
+
+    // Runs everything that is ready, waiting for something to become ready first if needed.
+    void run_once() {
+        if (ready.empty()) { wait(); }
+        std::deque<std::coroutine_handle<>> now_ready;
+        now_ready.swap(ready);
+        for (auto h: now_ready) { h.resume(); }
+    }
+
+private:
+    struct IoWait {
+        int fd;
+        short events;
+        std::coroutine_handle<> handle;
+    };
+
+    std::deque<std::coroutine_handle<>> ready;
+    std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> timers;
+    std::vector<IoWait> io;
+
+    void wait() {
+        if (timers.empty() && io.empty()) { return; }
+
+        int timeout_ms = -1;
+        if (!timers.empty()) {
+            auto until = timers.begin()->first - std::chrono::steady_clock::now();
+            // Round up, we'd rather not spin around the deadline
+            auto ms = std::chrono::ceil<std::chrono::milliseconds>(until).count();
+            timeout_ms = ms < 0 ? 0 : (int) ms;
+        }
+
+        std::vector<pollfd> fds;
+        fds.reserve(io.size());
+        for (const auto &wait: io) { fds.push_back(pollfd{wait.fd, wait.events, 0}); }
+        poll(fds.data(), fds.size(), timeout_ms);
+
+        std::vector<IoWait> still_waiting;
+        for (size_t i = 0; i < io.size(); i++) {
+            if (fds[i].revents != 0) {
+                ready.push_back(io[i].handle);
+            } else {
+                still_waiting.push_back(io[i]);
+            }
+        }
+        io.swap(still_waiting);
+
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            ready.push_back(timers.begin()->second);
+            timers.erase(timers.begin());
+        }
+    }
+};
+
+// The loop async tests (and the awaitables below) run on.
+EventLoop &event_loop() {
+    thread_local EventLoop loop;
+    return loop;
+}
+
+/* co_await sleep_for(std::chrono::milliseconds(5)); */
+auto sleep_for(std::chrono::steady_clock::duration duration) {
+    struct sleeper {
+        std::chrono::steady_clock::time_point at;
+        bool await_ready() const { return std::chrono::steady_clock::now() >= at; }
+        void await_suspend(std::coroutine_handle<> h) const { event_loop().wake_at(at, h); }
+        void await_resume() const {}
+    };
+    return sleeper{std::chrono::steady_clock::now() + duration};
+}
+
+/* co_await wait_for_fd(socket_fd, POLLIN); */
+auto wait_for_fd(int fd, short events) {
+    struct fd_waiter {
+        int fd;
+        short events;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h) const { event_loop().wake_on(fd, events, h); }
+        void await_resume() const {}
+    };
+    return fd_waiter{fd, events};
+}
+
+// Runs the task on the event loop until it finishes, rethrowing whatever it threw.
+void sync_wait(Task task) {
+    EventLoop &loop = event_loop();
+    loop.schedule(task.coroutine());
+    while (!task.is_done()) {
+        loop.run_once();
+    }
+    task.rethrow_if_failed();
+}
+
+/* Like `run()`, but for test functions returning a Task. Keeps up to
+   `in_flight` test cases running concurrently on the event loop, which helps
+   when they spend most of their time waiting on I/O.
+
+   Once a test case fails no new ones get started. The ones started before it
+   get to finish, so that the earliest failing case is the one reported (like
+   with `run()`, see shard.h); the rest are cancelled. The failure is then shrunk
+   as usual (one candidate at a time).
+
+   Values stay put while their test case runs, so the test function may take
+   them by const reference.
+ */
+template<typename T, typename FN>
+TestResult<T> run_async(Generator<T> generator, FN async_test_function, size_t in_flight = ASYNC_TESTS_IN_FLIGHT) {
+
+    struct Running {
+        Generated<T> generated;
+        std::optional<Task> task;
+        int case_index;
+    };
+
+    uint64_t seed = run_seed();
+    EventLoop &loop = event_loop();
+
+    std::list<Running> running;// a list, so that values don't move around while being tested
+    std::optional<Generated<T>> failed;
+    int failed_case = 0;
+    std::string fail_message;
+
+    auto cancel_all = [&]() {
+        loop.clear();
+        running.clear();
+    };
+    auto earlier_still_running = [&]() {
+        return std::any_of(running.begin(), running.end(), [&](const Running &r) { return r.case_index < failed_case; });
+    };
+
+    int next_case = 0;
+    while (failed ? earlier_still_running() : (next_case < MAX_GENERATED_VALUES_PER_TEST || !running.empty())) {
+        while (!failed && next_case < MAX_GENERATED_VALUES_PER_TEST && running.size() < in_flight) {
+            int case_index = next_case++;
+            if (!in_this_shard(case_index)) { continue; }
+            auto generated_case = generate_case(generator, seed, case_index);
+            if (auto cannot = std::get_if<CannotGenerateValues>(&generated_case)) {
+                cancel_all();
+                return std::move(*cannot);
+            }
+            Running &new_case = running.emplace_back(Running{std::move(std::get<Generated<T>>(generated_case)), std::nullopt, case_index});
+            new_case.task.emplace(async_test_function(new_case.generated.value));
+            loop.schedule(new_case.task->coroutine());
+        }
+
+        loop.run_once();
+
+        for (auto it = running.begin(); it != running.end();) {
+            if (!it->task->is_done()) {
+                ++it;
+                continue;
+            }
+            try {
+                it->task->rethrow_if_failed();
+            } catch (TestException &e) {
+                if (!failed || it->case_index < failed_case) {
+                    failed = std::move(it->generated);
+                    failed_case = it->case_index;
+                    fail_message = e.what();
+                }
+            } catch (...) {
+                cancel_all();
+                throw;
+            }
+            it = running.erase(it);
+        }
+    }
+
+    if (failed) {
+        cancel_all();
+        auto sync_test_function = [async_test_function](const T &value) mutable { sync_wait(async_test_function(value)); };
+        auto fails = shrink(std::move(*failed), generator, sync_test_function, fail_message);
+        fails.case_index = failed_case;
+        fails.seed = seed;
+        return fails;
+    }
+    // MAX_GENERATED_VALUES_PER_TEST values generated, all passed the test.
+    return Passes();
+}
+
+template<typename T, typename FN>
+void run_async_test(const std::string &name, Generator<T> gen, FN async_test_function) {
+    std::cout << "--------" << std::endl;
+    auto result = run_async(gen, async_test_function);
+    std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    write_shard_failure(name, result);
+}
+
+#endif//PBT_ASYNC_H
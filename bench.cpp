@@ -0,0 +1,63 @@
+#include "pbt.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Benchmarks generating and shrinking large values, counting how many times
+   they get copied on the way. Generated values should only ever be moved. */
+
+struct BigVector {
+    static inline size_t copies = 0;
+    std::vector<unsigned int> data;
+
+    explicit BigVector(size_t size) : data(size, 42) {}
+    BigVector(const BigVector &rhs) : data(rhs.data) { copies++; }
+    BigVector &operator=(const BigVector &rhs) {
+        data = rhs.data;
+        copies++;
+        return *this;
+    }
+    BigVector(BigVector &&) noexcept = default;
+    BigVector &operator=(BigVector &&) noexcept = default;
+};
+
+std::ostream &operator<<(std::ostream &os, const BigVector &v) { return os << "BigVector(size=" << v.data.size() << ")"; }
+std::string to_string(const BigVector &v) { return "BigVector(size=" + std::to_string(v.data.size()) + ")"; }
+
+// Doesn't even compile if anything on the way tries to copy it.
+struct MoveOnlyBig {
+    std::unique_ptr<std::vector<unsigned int>> data;
+};
+
+std::ostream &operator<<(std::ostream &os, const MoveOnlyBig &v) { return os << "MoveOnlyBig(size=" << v.data->size() << ")"; }
+std::string to_string(const MoveOnlyBig &v) { return "MoveOnlyBig(size=" + std::to_string(v.data->size()) + ")"; }
+
+template<typename T, typename FN>
+void bench(const std::string &name, Generator<T> gen, FN test_function) {
+    BigVector::copies = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto result = run(gen, test_function);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    std::cout << " - time: " << ms << "ms, copies of the value: " << BigVector::copies << std::endl;
+}
+
+int main() {
+    bench("BigVector: generate + shrink a 1M element vector",
+          Gen::unsigned_int(1000).map([](unsigned int n) { return BigVector(n * 1000); }),
+          [](const BigVector &v) {
+              if (v.data.size() > 300000) { throw TestException("Should be shrunk to size 301000"); }
+          });
+
+    bench("MoveOnlyBig: generate + shrink a move-only value",
+          Gen::unsigned_int(1000).map([](unsigned int n) {
+              return MoveOnlyBig{std::make_unique<std::vector<unsigned int>>(n * 1000, 42)};
+          }),
+          [](const MoveOnlyBig &v) {
+              if (v.data->size() > 300000) { throw TestException("Should be shrunk to size 301000"); }
+          });
+    return 0;
+}
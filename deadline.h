@@ -0,0 +1,65 @@
+#ifndef PBT_DEADLINE_H
+#define PBT_DEADLINE_H
+
+#include "scoped_current.h"
+#include "test_exception.h"
+
+#include <chrono>
+#include <string>
+#include <utility>
+
+/* Thrown when a test call runs over its deadline.
+
+   It's a TestException like any other, so `shrink()` will minimize the input
+   that makes the code under test slow. The message doesn't include the actual
+   time taken, so that all timeouts look like the same failure.
+ */
+class TimeoutException : public TestException {
+public:
+    explicit TimeoutException(std::chrono::milliseconds limit)
+        : TestException("Timed out (took longer than " + std::to_string(limit.count()) + "ms)") {}
+};
+
+struct Deadline {
+    std::chrono::steady_clock::time_point at;
+    std::chrono::milliseconds limit;
+};
+
+// The deadline of the test call running on this thread, if any.
+thread_local const Deadline *current_deadline = nullptr;
+
+/* Cooperative cancellation: code under test can call this in its loops to
+   bail out as soon as the current test call is over its deadline, instead of
+   running to completion (or forever).
+
+   Does nothing outside of `with_deadline`.
+ */
+void check_deadline() {
+    if (current_deadline && std::chrono::steady_clock::now() > current_deadline->at) {
+        throw TimeoutException(current_deadline->limit);
+    }
+}
+
+/* Wraps a test function so that calls taking longer than `limit` fail with
+   a TimeoutException:
+
+   run(generator, with_deadline(std::chrono::milliseconds(100), test_function));
+
+   Calls that go over the limit without ever calling `check_deadline()` still
+   fail, but only once they return.
+ */
+template<typename FN>
+auto with_deadline(std::chrono::milliseconds limit, FN test_function) {
+    return [limit, test_function](auto &&value) mutable {
+        Deadline deadline{std::chrono::steady_clock::now() + limit, limit};
+        ScopedCurrent<const Deadline> guard(current_deadline, &deadline);
+
+        test_function(std::forward<decltype(value)>(value));
+
+        if (std::chrono::steady_clock::now() > deadline.at) {
+            throw TimeoutException(limit);
+        }
+    };
+}
+
+#endif//PBT_DEADLINE_H
@@ -0,0 +1,101 @@
+#ifndef PBT_FUZZ_H
+#define PBT_FUZZ_H
+
+#include "gen_result.h"
+#include "generator.h"
+#include "rand_source.h"
+#include "random_run.h"
+#include "shrink.h"
+#include "test_exception.h"
+#include "test_result.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Decodes fuzzer bytes into a RandomRun: each choice is 4 bytes, little-endian.
+   Trailing bytes that don't make up a whole choice are ignored.
+
+   [0x05,0x00,0x00,0x00, 0x01,0x01,0x00,0x00, 0xFF] -> RandomRun [5,257]
+
+   The run is read leniently (see `next_lenient`): out of range choices wrap
+   around and missing ones read as 0, so that any input (even an empty one)
+   reaches the test function instead of being rejected.
+ */
+RandomRun random_run_from_bytes(const uint8_t *data, size_t size) {
+    std::vector<RAND_TYPE> choices;
+    size_t count = std::min(size / sizeof(RAND_TYPE), (size_t)MAX_RANDOMRUN_LENGTH);
+    choices.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        RAND_TYPE choice = 0;
+        for (size_t b = 0; b < sizeof(RAND_TYPE); b++) {
+            choice |= (RAND_TYPE)data[i * sizeof(RAND_TYPE) + b] << (8 * b);
+        }
+        choices.push_back(choice);
+    }
+    return RandomRun(std::move(choices));
+}
+
+/* Runs the test function on the value the fuzzer bytes decode to.
+
+   If the test fails, the run goes through the usual `shrink()`, starting from
+   the part of the run the generator actually read (after normalizing it).
+   Shrink candidates are read strictly, as usual.
+
+   fuzz(bytes of [5], Gen::unsigned_int(10), [](auto){ throw ...; }) --> FailsWith{0, ...}
+ */
+template<typename T, typename FN>
+TestResult<T> fuzz(const uint8_t *data, size_t size, const Generator<T> &generator, FN &&test_function) {
+    GenResult<T> gen_result = generator(Recorded{random_run_from_bytes(data, size), true});
+    if (auto rejected = std::get_if<Rejected>(&gen_result)) {
+        return CannotGenerateValues{std::map<std::string, int>{{rejected->reason, 1}}};
+    }
+    Generated<T> &generated = std::get<Generated<T>>(gen_result);
+    try {
+        test_function(generated.value);
+    } catch (TestException &e) {
+        Generated<T> trimmed{generated.run.consumed(), std::move(generated.value)};
+        return shrink(std::move(trimmed), generator, test_function, e.what());
+    }
+    return Passes();
+}
+
+/* The body of a libFuzzer target.
+
+   Rejected inputs (which only generators like `filter` produce now) return -1
+   so libFuzzer doesn't add them to the corpus.
+   A failure is shrunk and reported, then we abort so libFuzzer saves the input.
+ */
+template<typename T, typename FN>
+int fuzz_one_input(const uint8_t *data, size_t size, const Generator<T> &generator, FN &&test_function) {
+    TestResult<T> result = fuzz(data, size, generator, test_function);
+    if (std::holds_alternative<CannotGenerateValues>(result)) {
+        return -1;
+    }
+    if (std::holds_alternative<FailsWith<T>>(result)) {
+        std::cout << "[fuzz] " << to_string(result) << std::endl;
+        std::abort();
+    }
+    return 0;
+}
+
+/* Defines `LLVMFuzzerTestOneInput` for the given generator and test function.
+   Use it once per fuzzer executable (linked with -fsanitize=fuzzer):
+
+   PBT_FUZZ_TARGET(Gen::unsigned_int(10), [](unsigned int n) { ... })
+
+   The test function is taken as variadic arguments so that commas inside the
+   lambda body don't confuse the preprocessor.
+ */
+#define PBT_FUZZ_TARGET(generator, ...)                                           \
+    extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {     \
+        static auto pbt_fuzz_generator = (generator);                             \
+        static auto pbt_fuzz_test_function = (__VA_ARGS__);                       \
+        return fuzz_one_input(data, size, pbt_fuzz_generator, pbt_fuzz_test_function); \
+    }
+
+#endif//PBT_FUZZ_H
@@ -0,0 +1,11 @@
+#include "pbt.h"
+
+/* An example libFuzzer target. Build with -DPBT_BUILD_FUZZERS=ON (needs Clang)
+   and run the resulting `pbt_fuzz_example` executable.
+ */
+PBT_FUZZ_TARGET(Gen::unsigned_int(3,1000).map([](auto n){ return n * 2; }),
+                [](unsigned int n) {
+                    if (n > 1500) {
+                        throw TestException("Should be shrunk to 1502");
+                    }
+                })
@@ -21,7 +21,7 @@ using GenResult = std::variant<Generated<T>, Rejected>;
 
 template<typename T>
 GenResult<T> generated(RandomRun run, T val) {
-    return GenResult<T>{Generated<T>{run, val}};
+    return GenResult<T>{Generated<T>{std::move(run), std::move(val)}};
 }
 template<typename T>
 GenResult<T> rejected(std::string reason) {
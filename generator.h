@@ -1,25 +1,30 @@
 #ifndef PBT_GENERATOR_H
 #define PBT_GENERATOR_H
 
+#include "alias_table.h"
 #include "gen_result.h"
 #include "rand_source.h"
 #include "random_run.h"
 
 #include <functional>
+#include <memory>
 #include <random>
 #include <string>
 #include <utility>
 #include <variant>
+#include <vector>
 
 template<typename T>
 class Generator {
 public:
-    using FunctionType = std::function<GenResult<T>(RandSource const &)>;
+    // Sources are moved through the generators, so that the run grows in place
+    // instead of getting copied at every draw.
+    using FunctionType = std::function<GenResult<T>(RandSource)>;
 
     explicit Generator(FunctionType function) : fn(std::move(function)) {}
 
-    GenResult<T> operator()(RandSource source) {
-        return fn(source);
+    GenResult<T> operator()(RandSource source) const {
+        return fn(std::move(source));
     }
 
     /* Runs the provided function on each value of the generator.
@@ -39,19 +44,17 @@ public:
         using U = std::invoke_result_t<FN, T>;
         auto fn = this->fn;
         return Generator<U>([fn, map_fn](RandSource rand) {
-            GenResult<T> result = fn(rand);
+            GenResult<T> result = fn(std::move(rand));
             struct mapper {
-                FN map_function;
-                explicit mapper(FN map_function) : map_function(map_function) {}
-                GenResult<U> operator()(Generated<T> g) {
-                    auto val2 = map_function(g.value);
-                    return generated(g.run, val2);
+                const FN &map_function;
+                GenResult<U> operator()(Generated<T> &&g) {
+                    return generated(std::move(g.run), map_function(std::move(g.value)));
                 }
-                GenResult<U> operator()(const Rejected &r) {
-                    return r;
+                GenResult<U> operator()(Rejected &&r) {
+                    return std::move(r);
                 }
             };
-            return std::visit(mapper{map_fn}, result);
+            return std::visit(mapper{map_fn}, std::move(result));
         });
     }
     
@@ -69,24 +72,23 @@ public:
     Generator<T> filter(FN predicate) const {
         auto fn = this->fn;
         return Generator<T>([fn, predicate](RandSource rand) {
-            GenResult<T> result = fn(rand);
+            GenResult<T> result = fn(std::move(rand));
             
             struct filter_mapper {
-                FN predicate_function;
-                explicit filter_mapper(FN predicate_function) : predicate_function(predicate_function) {}
-                GenResult<T> operator()(Generated<T> g) {
-                    if (predicate_function(g.value)) {
-                        return g;
+                const FN &predicate_function;
+                GenResult<T> operator()(Generated<T> &&g) {
+                    if (predicate_function(std::as_const(g.value))) {
+                        return std::move(g);
                     } else {
                         return rejected<T>("Value filtered out");
                     }
                 }
-                GenResult<T> operator()(const Rejected &r) {
-                    return r;
+                GenResult<T> operator()(Rejected &&r) {
+                    return std::move(r);
                 }
             };
             
-            return std::visit(filter_mapper{predicate}, result);
+            return std::visit(filter_mapper{predicate}, std::move(result));
         });
     }
 
@@ -105,8 +107,9 @@ namespace Gen {
      */
     template<typename T>
     Generator<T> constant(T const &val) {
-        return Generator<T>([val](RandSource const &) {
-            return generated(RandomRun(), val);
+        return Generator<T>([val](RandSource rand) {
+            // Keep whatever the run already contains when composed with other generators
+            return generated(std::move(random_run(rand)), val);
         });
     }
 
@@ -141,7 +144,7 @@ namespace Gen {
        Shrinks towards 0.
      */
     Generator<unsigned int> unsigned_int(unsigned int max) {
-        return Generator<unsigned int>([max](RandSource const &rand) {
+        return Generator<unsigned int>([max](RandSource rand) {
             if (random_run(rand).is_full()) {
                 return rejected<unsigned int>("Generators have hit maximum RandomRun length (generating too much data).");
             }
@@ -149,21 +152,29 @@ namespace Gen {
                 unsigned int max_value;
                 explicit handler(unsigned int max) : max_value(max) {}
 
-                GenResult<unsigned int> operator()(Live l) const {
+                GenResult<unsigned int> operator()(Live &&l) const {
                     std::uniform_int_distribution<unsigned int> dist(0, max_value);
                     auto val = dist(l.rng);
                     l.run.push_back(val);
-                    return generated(l.run, val);
+                    return generated(std::move(l.run), val);
                 }
-                GenResult<unsigned int> operator()(Recorded r) {
-                    if (r.run.is_empty()) {
+                GenResult<unsigned int> operator()(Recorded &&r) const {
+                    if (r.lenient) {
+                        auto val = next_lenient(r, max_value);
+                        return generated(std::move(r.run), val);
+                    }
+                    if (r.run.is_exhausted()) {
                         return rejected<unsigned int>("Ran out of recorded bits");
                     }
                     auto val = r.run.next();
-                    return generated(r.run, val);
+                    if (val > max_value) {
+                        // Only possible with runs we didn't generate ourselves (eg. fuzzer input)
+                        return rejected<unsigned int>("Recorded value out of range");
+                    }
+                    return generated(std::move(r.run), val);
                 }
             };
-            return std::visit(handler{max}, rand);
+            return std::visit(handler{max}, std::move(rand));
         });
     }
 
@@ -194,6 +205,92 @@ namespace Gen {
         return Gen::unsigned_int(range).map([min](unsigned int x){ return x + min; });
     }
 
+    /* Picks one of the given generators, with probability proportional to its
+       weight, and generates a value with it.
+
+       The pick is precomputed into an alias table when the generator is
+       created, so each draw costs O(1) regardless of the number of
+       alternatives. It takes a single choice in the RandomRun (the index of
+       the alternative), followed by the choices of the alternative itself:
+
+       Gen::frequency({{1, Gen::constant(5u)},
+                       {3, Gen::unsigned_int(10)}}) -> value 5, RandomRun [0]   (25%)
+                                                    -> value 7, RandomRun [1,7] (75%)
+
+       Shrinks towards the first alternative (and then within the alternative).
+     */
+    template<typename T>
+    Generator<T> frequency(std::vector<std::pair<unsigned int, Generator<T>>> alternatives) {
+        std::vector<unsigned int> weights;
+        std::vector<Generator<T>> generators;
+        for (auto &[weight, generator]: alternatives) {
+            weights.push_back(weight);
+            generators.push_back(generator);
+        }
+        bool any_positive = false;
+        for (auto w: weights) { any_positive = any_positive || w > 0; }
+        if (!any_positive) {
+            return reject<T>("frequency() needs an alternative with a positive weight");
+        }
+
+        auto table = std::make_shared<const AliasTable>(weights);
+        return Generator<T>([table, weights, generators](RandSource rand) {
+            if (random_run(rand).is_full()) {
+                return rejected<T>("Generators have hit maximum RandomRun length (generating too much data).");
+            }
+            // Writes / reads the pick in place, leaving the source ready for the picked generator
+            struct picker {
+                const AliasTable &table;
+                const std::vector<unsigned int> &weights;
+
+                std::variant<unsigned int, Rejected> operator()(Live &l) const {
+                    auto index = (unsigned int) table.sample(l.rng);
+                    l.run.push_back(index);
+                    return index;
+                }
+                std::variant<unsigned int, Rejected> operator()(Recorded &r) const {
+                    if (r.lenient) {
+                        // Skip over alternatives that can't be picked
+                        auto index = next_lenient(r, (unsigned int) weights.size() - 1);
+                        while (weights[index] == 0) { index = (index + 1) % (unsigned int) weights.size(); }
+                        r.run.set_at(r.run.position() - 1, index);
+                        return index;
+                    }
+                    if (r.run.is_exhausted()) {
+                        return Rejected{"Ran out of recorded bits"};
+                    }
+                    auto index = r.run.next();
+                    if (index >= weights.size() || weights[index] == 0) {
+                        return Rejected{"Recorded alternative can't be picked"};
+                    }
+                    return index;
+                }
+            };
+            auto pick = std::visit(picker{*table, weights}, rand);
+            if (auto r = std::get_if<Rejected>(&pick)) {
+                return rejected<T>(r->reason);
+            }
+            return generators[std::get<unsigned int>(pick)](std::move(rand));
+        });
+    }
+
+    /* Picks one of the given generators (each equally likely) and generates
+       a value with it.
+
+       Gen::one_of({Gen::unsigned_int(0,10), Gen::unsigned_int(100,110)}) -> value 4,   RandomRun [0,4]
+                                                                          -> value 105, RandomRun [1,5]
+
+       Shrinks towards the first alternative. See `frequency` for details.
+     */
+    template<typename T>
+    Generator<T> one_of(std::vector<Generator<T>> alternatives) {
+        std::vector<std::pair<unsigned int, Generator<T>>> weighted;
+        for (auto &generator: alternatives) {
+            weighted.emplace_back(1, generator);
+        }
+        return frequency(weighted);
+    }
+
 }// namespace Gen
 
 #endif//PBT_GENERATOR_H
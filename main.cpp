@@ -1,4 +1,9 @@
+#include "allocations.h"
+#include "async.h"
 #include "pbt.h"
+#include "stateful.h"
+
+#include <filesystem>
 
 void test_constant() {
     run_test("constant(42) should always generate 42",
@@ -92,7 +97,314 @@ void test_filter_shrinking() {
              [](unsigned int n) { throw TestException("Should be shrunk to 4"); });
 }
 
-int main() {
+void test_fuzz_shrinking() {
+    std::cout << "--------" << std::endl;
+    std::vector<uint8_t> bytes = {7,0,0,0, 3,0,0,0, 0xAB}; // RandomRun [7,3], trailing byte ignored
+    auto result = fuzz(bytes.data(),
+                       bytes.size(),
+                       Gen::unsigned_int(10),
+                       [](unsigned int n) { throw TestException("Should be shrunk to 0"); });
+    std::cout << "[fuzz() - failure found from bytes shrinks to 0] " << to_string(result) << std::endl;
+}
+
+void test_fuzz_out_of_range() {
+    std::cout << "--------" << std::endl;
+    std::vector<uint8_t> bytes = {0xFF,0xFF,0xFF,0xFF}; // RandomRun [4294967295], wraps to [4294967295 % 11]
+    auto result = fuzz(bytes.data(),
+                       bytes.size(),
+                       Gen::unsigned_int(10),
+                       [](unsigned int n) { if (n != 4294967295u % 11) { throw TestException("This shouldn't be possible"); } });
+    std::cout << "[fuzz() - bytes out of the generator's range wrap around] " << to_string(result) << std::endl;
+
+    std::cout << "--------" << std::endl;
+    auto empty = fuzz(bytes.data(),
+                      0,
+                      Gen::one_of<unsigned int>({Gen::constant(0u), Gen::unsigned_int(10)}),
+                      [](unsigned int n) { throw TestException("Should be shrunk to 0"); });
+    std::cout << "[fuzz() - empty input reads as zeros] " << to_string(empty) << std::endl;
+
+    std::cout << "--------" << std::endl;
+    std::vector<uint8_t> zero_weight = {1,0,0,0}; // picks the alternative with weight 0, moves on to the next one
+    auto skipped = fuzz(zero_weight.data(),
+                        zero_weight.size(),
+                        Gen::frequency<unsigned int>({{1, Gen::constant(1u)}, {0, Gen::constant(2u)}, {1, Gen::constant(3u)}}),
+                        [](unsigned int n) { if (n != 3) { throw TestException("This shouldn't be possible"); } });
+    std::cout << "[fuzz() - alternatives with weight 0 are skipped over] " << to_string(skipped) << std::endl;
+}
+
+/* A counter that forgets increments once it reaches 3 and we decrement it.
+   Takes a few commands to get into the buggy state, so it's a good candidate
+   for shrinking via snapshots.
+ */
+struct BuggyCounter {
+    int count = 0;
+    bool was_decremented = false;
+    void inc() { if (!(count >= 3 && was_decremented)) { count++; } }
+    void dec() { count--; was_decremented = true; }
+};
+
+StateMachine<int, BuggyCounter, std::string> counter_machine(bool snapshots) {
+    StateMachine<int, BuggyCounter, std::string> machine{
+            Gen::unsigned_int(1).map([](unsigned int n) { return std::string(n == 0 ? "inc" : "dec"); }),
+            []() { return 0; },
+            []() { return BuggyCounter(); },
+            [](const std::string &cmd, int &model, BuggyCounter &system) {
+                if (cmd == "inc") { model++; system.inc(); }
+                else              { model--; system.dec(); }
+                if (model != system.count) {
+                    throw TestException("Model says " + std::to_string(model) + ", system says " + std::to_string(system.count));
+                }
+            }};
+    machine.snapshots = snapshots;
+    return machine;
+}
+
+void test_stateful_shrinking() {
+    run_stateful_test("stateful - finds and shrinks the counter bug",
+                      counter_machine(false));
+}
+
+void test_stateful_snapshots() {
+    run_stateful_test("stateful - snapshots skip replaying shared command prefixes",
+                      counter_machine(true));
+}
+
+// The same counter, but behind a unique_ptr like a socket or a file handle would be: not copyable.
+struct CounterHandle {
+    std::unique_ptr<BuggyCounter> counter = std::make_unique<BuggyCounter>();
+};
+
+void test_stateful_non_copyable() {
+    StateMachine<int, CounterHandle, std::string> machine{
+            Gen::unsigned_int(1).map([](unsigned int n) { return std::string(n == 0 ? "inc" : "dec"); }),
+            []() { return 0; },
+            []() { return CounterHandle(); },
+            [](const std::string &cmd, int &model, CounterHandle &system) {
+                if (cmd == "inc") { model++; system.counter->inc(); }
+                else              { model--; system.counter->dec(); }
+                if (model != system.counter->count) {
+                    throw TestException("Model says " + std::to_string(model) + ", system says " + std::to_string(system.counter->count));
+                }
+            }};
+    machine.snapshots = true;// ignored, can't snapshot a unique_ptr
+    run_stateful_test("stateful - non-copyable systems work (without snapshots)", machine);
+}
+
+void test_shrink_profiling() {
+    shrink_profiling = true;
+    run_test("shrink profiling - prints a per-ShrinkCmd report",
+             Gen::unsigned_int(1000).filter([](auto n){ return n % 7 != 0; }),
+             [](unsigned int n) { if (n > 500) { throw TestException("Should be shrunk to 501"); } });
+    shrink_profiling = false;
+}
+
+void test_deadline_shrinking() {
+    run_test("with_deadline() - hanging inputs shrink to the smallest one",
+             Gen::unsigned_int(1000),
+             with_deadline(std::chrono::milliseconds(20), [](unsigned int n) {
+                 if (n > 600) {
+                     while (true) { check_deadline(); }// "Should be shrunk to 601"
+                 }
+             }));
+}
+
+void test_async() {
+    run_async_test("run_async() - I/O-bound tests overlap",
+                   Gen::unsigned_int(1000),
+                   [](unsigned int n) -> Task {
+                       co_await sleep_for(std::chrono::milliseconds(3));
+                       if (n > 1000) { throw TestException("This shouldn't be possible"); }
+                   });
+}
+
+void test_async_shrinking() {
+    run_async_test("run_async() - failures get shrunk",
+                   Gen::unsigned_int(1000),
+                   [](unsigned int n) -> Task {
+                       co_await sleep_for(std::chrono::milliseconds(3));
+                       if (n > 500) { throw TestException("Should be shrunk to 501"); }
+                   });
+}
+
+void test_distinct_failures() {
+    run_distinct_test("run_distinct() - reports each distinct failure, shrunk on its own",
+                      Gen::unsigned_int(1000),
+                      [](unsigned int n) {
+                          if (n > 500)     { throw TestException("Too big, should be shrunk to 501"); }
+                          if (n % 2 == 1)  { throw TestException("Odd, should be shrunk to 1"); }
+                      });
+}
+
+void test_batch() {
+    run_batch_test("run_batch() - checks values a batch at a time",
+                   Gen::unsigned_int(10),
+                   [](std::span<const unsigned int> values) -> std::optional<size_t> {
+                       for (size_t i = 0; i < values.size(); i++) {
+                           if (values[i] > 10) { return i; }
+                       }
+                       return std::nullopt;
+                   });
+}
+
+void test_batch_shrinking() {
+    run_batch_test("run_batch() - only the failing value gets shrunk",
+                   Gen::unsigned_int(1000),
+                   [](std::span<const unsigned int> values) -> std::optional<size_t> {
+                       unsigned int too_big = 0;// branch-free, so the loop can be vectorized
+                       for (unsigned int v: values) { too_big += v > 500; }
+                       if (too_big == 0) { return std::nullopt; }
+                       return std::find_if(values.begin(), values.end(), [](auto v) { return v > 500; }) - values.begin();
+                   });
+}
+
+void test_batch_bad_index() {
+    std::cout << "--------" << std::endl;
+    try {
+        run_batch(Gen::unsigned_int(1000),
+                  [](std::span<const unsigned int> values) -> std::optional<size_t> { return values.size(); });
+        std::cout << "[run_batch() - out of range index is an error] Passes (shouldn't be possible)" << std::endl;
+    } catch (std::out_of_range &e) {
+        std::cout << "[run_batch() - out of range index is an error] " << e.what() << std::endl;
+    }
+
+    std::cout << "--------" << std::endl;
+    try {
+        run_batch(Gen::unsigned_int(1000),
+                  [](std::span<const unsigned int>) -> std::optional<size_t> { return std::nullopt; },
+                  0);
+        std::cout << "[run_batch() - batch size 0 is an error] Passes (shouldn't be possible)" << std::endl;
+    } catch (std::invalid_argument &e) {
+        std::cout << "[run_batch() - batch size 0 is an error] " << e.what() << std::endl;
+    }
+}
+
+void test_shrink_budget() {
+    auto generator = Gen::unsigned_int(1000);
+    auto test_function = [](unsigned int n) { if (n > 500) { throw TestException("Should be shrunk to 501"); } };
+
+    shrink_budget.max_test_calls = 4;
+    std::cout << "--------" << std::endl;
+    auto result = resume(RandomRun({1000}), generator, test_function);
+    std::cout << "[shrink budget - stops early with the best value so far] " << to_string(result) << std::endl;
+    shrink_budget = ShrinkBudget();
+
+    std::cout << "--------" << std::endl;
+    auto saved = std::get<FailsWith<unsigned int>>(result).run;
+    auto resumed = resume(*random_run_from_string((std::ostringstream() << saved).str()), generator, test_function);
+    std::cout << "[resume() - carries on shrinking from a saved run] " << to_string(resumed) << std::endl;
+}
+
+void test_one_of() {
+    run_test("one_of() picks values from all alternatives",
+             Gen::one_of<unsigned int>({Gen::unsigned_int(0,10), Gen::unsigned_int(100,110)}),
+             [](unsigned int n) {
+                 if (n > 10 && n < 100) { throw TestException("Got something in between: " + std::to_string(n)); }
+                 if (n > 110)           { throw TestException("Got something above 110: " + std::to_string(n)); }
+             });
+}
+
+void test_one_of_shrinking() {
+    run_test("one_of() - shrinks within the alternative that fails",
+             Gen::one_of<unsigned int>({Gen::unsigned_int(0,10), Gen::unsigned_int(100,110)}),
+             [](unsigned int n) { if (n > 50) { throw TestException("Should be shrunk to 100"); } });
+}
+
+void test_frequency_shrinking() {
+    run_test("frequency() - shrinks towards the first alternative",
+             Gen::frequency<unsigned int>({{1, Gen::constant(1u)},
+                                           {0, Gen::constant(2u)},
+                                           {1000, Gen::constant(3u)}}),
+             [](unsigned int n) { throw TestException("Should be shrunk to 1"); });
+}
+
+void test_sharding() {
+    auto generator = Gen::unsigned_int(1000);
+    auto test_function = [](unsigned int n) { if (n > 500 && n % 3 == 1) { throw TestException("Odd one out"); } };
+    RunConfig saved_config = run_config;
+    run_config = RunConfig();
+    run_config.seed = 1234;
+
+    auto unsharded = std::get<FailsWith<unsigned int>>(run(generator, test_function));
+
+    std::vector<ShardFailure> shard_failures;
+    run_config.shard_count = 16;
+    for (unsigned int shard = 0; shard < 16; shard++) {
+        run_config.shard_index = shard;
+        auto result = run(generator, test_function);
+        if (auto fails = std::get_if<FailsWith<unsigned int>>(&result)) {
+            shard_failures.push_back(ShardFailure{"sharded", fails->case_index, fails->run, fails->error});
+        }
+    }
+    run_config = saved_config;
+
+    auto merged = merge_shard_failures(shard_failures).at("sharded");
+    bool same = merged.case_index == unsharded.case_index && merged.run == unsharded.run;
+    std::cout << "--------" << std::endl;
+    std::cout << "[--shard 0..15/16 - merged result is the same as unsharded] "
+              << (same ? "Same" : "Different") << ": case #" << merged.case_index << ", " << merged.run
+              << " (unsharded: case #" << unsharded.case_index << ", " << unsharded.run << ")" << std::endl;
+}
+
+void test_memory_limit_shrinking() {
+    run_test("with_memory_limit() - memory blowups shrink to the smallest one",
+             Gen::unsigned_int(1000),
+             with_memory_limit(600000, [](unsigned int n) {
+                 std::vector<char> buffer(n * 1000);// "Should be shrunk to 601"
+             }));
+}
+
+void test_memory_limit_runaway() {
+    run_test("with_memory_limit() - runaway allocations are stopped at the limit",
+             Gen::unsigned_int(1000),
+             with_memory_limit(1 << 20, [](unsigned int n) {
+                 if (n > 600) {// "Should be shrunk to 601"
+                     std::vector<std::string> leak;
+                     while (true) { leak.emplace_back(1000, 'x'); }
+                 }
+             }));
+}
+
+void test_allocation_report() {
+    AllocationReport report;
+    run_test("track_allocations() - reports allocations per test call",
+             Gen::unsigned_int(1000),
+             track_allocations(report, [](unsigned int n) {
+                 std::vector<unsigned int> buffer(n);
+                 std::string label = "a string long enough to not fit into SSO: " + std::to_string(n);
+             }));
+    print_allocation_report(report);
+
+    std::mt19937 rng(0);
+    AllocationScope scope;
+    auto generated = Gen::unsigned_int(1000)(Live{RandomRun(), rng});
+    std::cout << "[AllocationScope - framework overhead of generating one unsigned_int] "
+              << scope.stats().allocations << " allocations, " << scope.stats().total_bytes << " bytes" << std::endl;
+}
+
+void test_shard_failure_escaping() {
+    RunConfig saved_config = run_config;
+    run_config.failures_path = (std::filesystem::temp_directory_path() / "pbt-escaping-test.txt").string();
+    std::filesystem::remove(run_config.failures_path);
+
+    ShardFailure written{"name with\ttab", 3, RandomRun({1, 2}), "multi\nline\\error\t"};
+    write_shard_failure(written);
+    auto read = read_shard_failures(run_config.failures_path);
+    std::filesystem::remove(run_config.failures_path);
+    run_config = saved_config;
+
+    bool same = read.size() == 1 && read[0].test_name == written.test_name && read[0].case_index == written.case_index &&
+                read[0].run == written.run && read[0].error == written.error;
+    std::cout << "--------" << std::endl;
+    std::cout << "[shard failures - tabs and newlines survive the failures file] " << (same ? "Same" : "Different") << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_run_args(argc, argv)) { return 1; }
+    if (!run_config.merge_paths.empty()) {
+        print_merged_shard_failures(run_config.merge_paths);
+        return 0;
+    }
+
     test_constant();
     test_constant_shrinking();
     test_unsigned_int_max_bounds();
@@ -105,5 +417,27 @@ int main() {
     test_filter();
     test_filter_degenerate_case();
     test_filter_shrinking();
+    test_fuzz_shrinking();
+    test_fuzz_out_of_range();
+    test_stateful_shrinking();
+    test_stateful_snapshots();
+    test_stateful_non_copyable();
+    test_shrink_profiling();
+    test_deadline_shrinking();
+    test_async();
+    test_async_shrinking();
+    test_distinct_failures();
+    test_batch();
+    test_batch_shrinking();
+    test_batch_bad_index();
+    test_shrink_budget();
+    test_one_of();
+    test_one_of_shrinking();
+    test_frequency_shrinking();
+    test_sharding();
+    test_shard_failure_escaping();
+    test_memory_limit_shrinking();
+    test_memory_limit_runaway();
+    test_allocation_report();
     return 0;
 }
@@ -1,58 +1,263 @@
 #ifndef PBT_PBT_H
 #define PBT_PBT_H
 
+#include "deadline.h"
+#include "fuzz.h"
 #include "gen_result.h"
 #include "generator.h"
 #include "rand_source.h"
 #include "random_run.h"
+#include "shard.h"
 #include "shrink.h"
 #include "test_exception.h"
 #include "test_result.h"
 
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <optional>
 #include <random>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <variant>
+#include <vector>
 
 #define MAX_GENERATED_VALUES_PER_TEST 100
 #define MAX_GEN_ATTEMPTS_PER_VALUE 15
+#define DEFAULT_BATCH_SIZE 64
 
+/* Generates the value of test case #case_index from the case's own RNG (see
+   `case_rng()`), giving up after MAX_GEN_ATTEMPTS_PER_VALUE rejections.
+
+   All the runners generate their test cases through this, so that `--seed`
+   and `--shard` mean the same thing for all of them.
+ */
+template<typename T>
+std::variant<Generated<T>, CannotGenerateValues> generate_case(const Generator<T> &generator, uint64_t seed, int case_index) {
+    std::mt19937 rng = case_rng(seed, case_index);
+    std::map<std::string, int> rejections;
+    for (int gen_attempt = 0; gen_attempt < MAX_GEN_ATTEMPTS_PER_VALUE; gen_attempt++) {
+        GenResult<T> gen_result = generator(Live{RandomRun(), rng});
+        if (auto generated = std::get_if<Generated<T>>(&gen_result)) {
+            return std::move(*generated);
+        }
+        rejections[std::get<Rejected>(gen_result).reason]++;
+    }
+    return CannotGenerateValues{rejections};
+}
+
+/* With `--shard i/n` only every n-th test case runs here, and since the cases
+   are visited in order, the first failure found is the same one an unsharded
+   run would find (if it falls into this shard).
+ */
 template<typename T, typename FN>
 TestResult<T> run(Generator<T> generator, FN test_function) {
 
-    std::random_device r;
-    std::mt19937 rng(r());
+    uint64_t seed = run_seed();
 
     for (int i = 0; i < MAX_GENERATED_VALUES_PER_TEST; i++) {
-        std::map<std::string, int> rejections;
-        bool generated_successfully = false;
-        for (int gen_attempt = 0; gen_attempt < MAX_GEN_ATTEMPTS_PER_VALUE && !generated_successfully; gen_attempt++) {
-            Live live_source{RandomRun(), rng};
-            GenResult<T> gen_result = generator(live_source);
-            if (auto generated = std::get_if<Generated<T>>(&gen_result)) {
-                generated_successfully = true;
-                try {
-                    test_function(generated->value);
-                } catch (TestException &e) {
-                    return shrink(*generated, generator, test_function, e.what());
-                }
-            } else if (auto rejected = std::get_if<Rejected>(&gen_result)) {
-                rejections[rejected->reason]++;
+        if (!in_this_shard(i)) { continue; }
+        auto generated_case = generate_case(generator, seed, i);
+        if (auto cannot = std::get_if<CannotGenerateValues>(&generated_case)) {
+            return std::move(*cannot);
+        }
+        auto &generated = std::get<Generated<T>>(generated_case);
+        try {
+            test_function(generated.value);
+        } catch (TestException &e) {
+            auto fails = shrink(std::move(generated), generator, test_function, e.what());
+            fails.case_index = i;
+            fails.seed = seed;
+            return fails;
+        }
+    }
+    // MAX_GENERATED_VALUES_PER_TEST values generated, all passed the test.
+    return Passes();
+}
+
+/* Like `run()`, but doesn't stop at the first failure: keeps generating values
+   and reports the minimal counterexample of each distinct failure (keyed by
+   the error message).
+
+   Failures that have already been minimized aren't shrunk again, and the
+   shrinker doesn't slip from one failure to another: a candidate failing with
+   a different message is noted down and shrunk separately later.
+ */
+template<typename T, typename FN>
+DistinctTestResult<T> run_distinct(Generator<T> generator, FN test_function) {
+
+    uint64_t seed = run_seed();
+    FailureRegistry<T> failures;
+    std::vector<FailsWith<T>> minimal;
+
+    auto shrink_pending = [&](int case_index) {
+        while (auto pending = failures.take_next_to_minimize()) {
+            Generated<T> generated{std::move(pending->run), std::move(pending->value)};
+            minimal.push_back(shrink(std::move(generated), generator, test_function, std::move(pending->fail_message), &failures));
+            minimal.back().case_index = case_index;
+            minimal.back().seed = seed;
+        }
+    };
+
+    for (int i = 0; i < MAX_GENERATED_VALUES_PER_TEST; i++) {
+        if (!in_this_shard(i)) { continue; }
+        auto generated_case = generate_case(generator, seed, i);
+        if (auto cannot = std::get_if<CannotGenerateValues>(&generated_case)) {
+            if (!minimal.empty()) { break; }
+            return std::move(*cannot);
+        }
+        auto &generated = std::get<Generated<T>>(generated_case);
+        try {
+            test_function(generated.value);
+        } catch (TestException &e) {
+            std::string message = e.what();
+            if (!failures.is_minimized(message)) {// otherwise we've seen this bug already
+                failures.record(ShrinkState<T>{std::move(generated.run), std::move(generated.value), message});
+                shrink_pending(i);
+            }
+        }
+    }
+
+    if (minimal.empty()) {
+        return Passes();
+    }
+    return FailsWithAll<T>{std::move(minimal)};
+}
+
+/* Like `run()`, but the test function checks a whole batch of values in one
+   call and returns the index of a failing value (if any):
+
+   run_batch(Gen::unsigned_int(1000),
+             [](std::span<const unsigned int> values) -> std::optional<size_t> { ... });
+
+   The values are generated into contiguous storage, which lets cheap,
+   data-parallel properties run as a single (vectorizable) loop. Only the
+   failing value gets shrunk, by calling the test function with batches of one.
+   Return the first failing index, so that sharded runs agree with unsharded
+   ones (see shard.h).
+
+   Throws std::invalid_argument if `batch_size` is 0, and std::out_of_range if
+   the test function returns an index outside of the batch.
+ */
+template<typename T, typename FN>
+TestResult<T> run_batch(Generator<T> generator, FN batch_test_function, size_t batch_size = DEFAULT_BATCH_SIZE) {
+
+    if (batch_size == 0) {
+        throw std::invalid_argument("run_batch() needs a batch_size of at least 1");
+    }
+    uint64_t seed = run_seed();
+
+    std::vector<T> values;
+    std::vector<RandomRun> runs;
+    std::vector<int> case_indices;
+    values.reserve(batch_size);
+    runs.reserve(batch_size);
+    case_indices.reserve(batch_size);
+
+    int next_case = 0;
+    while (next_case < MAX_GENERATED_VALUES_PER_TEST) {
+        values.clear();
+        runs.clear();
+        case_indices.clear();
+        for (; next_case < MAX_GENERATED_VALUES_PER_TEST && values.size() < batch_size; next_case++) {
+            if (!in_this_shard(next_case)) { continue; }
+            auto generated_case = generate_case(generator, seed, next_case);
+            if (auto cannot = std::get_if<CannotGenerateValues>(&generated_case)) {
+                return std::move(*cannot);
             }
+            auto &generated = std::get<Generated<T>>(generated_case);
+            values.push_back(std::move(generated.value));
+            runs.push_back(std::move(generated.run));
+            case_indices.push_back(next_case);
         }
-        if (!generated_successfully) { // meaning the loop above got to the full MAX_GEN_ATTEMPTS_PER_VALUE and gave up
-            return CannotGenerateValues{rejections};
+        if (values.empty()) { break; }
+
+        std::optional<size_t> failed_at = batch_test_function(std::span<const T>(values));
+        if (failed_at && *failed_at >= values.size()) {
+            // Something in the batch failed, but we can't tell what: a bug in the test function.
+            throw std::out_of_range("Batch test function returned index " + std::to_string(*failed_at) +
+                                    " for a batch of " + std::to_string(values.size()) + " values");
+        }
+        if (failed_at) {
+            auto test_function = [batch_test_function](const T &value) mutable {
+                if (batch_test_function(std::span<const T>(&value, 1))) {
+                    throw TestException("Failed the batch test");
+                }
+            };
+            Generated<T> generated{std::move(runs[*failed_at]), std::move(values[*failed_at])};
+            auto fails = shrink(std::move(generated), generator, test_function, "Failed the batch test");
+            fails.case_index = case_indices[*failed_at];
+            fails.seed = seed;
+            return fails;
         }
     }
     // MAX_GENERATED_VALUES_PER_TEST values generated, all passed the test.
     return Passes();
 }
 
+/* Replays a run saved from an earlier failure (eg. one that ran out of shrink
+   budget) and carries on shrinking it:
+
+   resume(*random_run_from_string("[12,0,7]"), generator, test_function)
+
+   Passes if the run doesn't fail anymore.
+ */
+template<typename T, typename FN>
+TestResult<T> resume(RandomRun saved_run, Generator<T> generator, FN test_function) {
+    GenResult<T> gen_result = generator(Recorded{saved_run});
+    if (auto rejected = std::get_if<Rejected>(&gen_result)) {
+        return CannotGenerateValues{std::map<std::string, int>{{rejected->reason, 1}}};
+    }
+    Generated<T> generated{std::move(saved_run), std::move(std::get<Generated<T>>(gen_result).value)};
+    try {
+        test_function(generated.value);
+    } catch (TestException &e) {
+        return shrink(std::move(generated), generator, test_function, e.what());
+    }
+    return Passes();
+}
+
+// Notes the failure (if any) down for `--merge`, see shard.h.
+template<typename T>
+void write_shard_failure(const std::string &name, const TestResult<T> &result) {
+    if (auto fails = std::get_if<FailsWith<T>>(&result)) {
+        write_shard_failure(ShardFailure{name, fails->case_index, fails->run, fails->error});
+    }
+}
+
+// Each distinct failure gets merged on its own.
+template<typename T>
+void write_shard_failure(const std::string &name, const DistinctTestResult<T> &result) {
+    if (auto fails = std::get_if<FailsWithAll<T>>(&result)) {
+        for (const auto &f: fails->failures) {
+            write_shard_failure(ShardFailure{name + " / " + f.error, f.case_index, f.run, f.error});
+        }
+    }
+}
+
 template<typename T, typename FN>
 void run_test(const std::string &name, Generator<T> gen, FN test_function) {
     std::cout << "--------" << std::endl;
     auto result = run(gen, test_function);
     std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    write_shard_failure(name, result);
+}
+
+template<typename T, typename FN>
+void run_batch_test(const std::string &name, Generator<T> gen, FN batch_test_function) {
+    std::cout << "--------" << std::endl;
+    auto result = run_batch(gen, batch_test_function);
+    std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    write_shard_failure(name, result);
+}
+
+template<typename T, typename FN>
+void run_distinct_test(const std::string &name, Generator<T> gen, FN test_function) {
+    std::cout << "--------" << std::endl;
+    auto result = run_distinct(gen, test_function);
+    std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    write_shard_failure(name, result);
 }
 
 #endif//PBT_PBT_H
@@ -4,6 +4,7 @@
 #include "random_run.h"
 
 #include <random>
+#include <utility>
 #include <variant>
 
 struct Live {
@@ -11,16 +12,63 @@ struct Live {
     std::mt19937 &rng;
 };
 struct Recorded {
-    RandomRun run;// in the process of being consumed
+    RandomRun run;       // in the process of being consumed
+    bool lenient = false;// see `next_lenient`
 };
 using RandSource = std::variant<Live, Recorded>;
 
-RandomRun random_run(RandSource rand) {
+// The run inside the source, without copying it.
+const RandomRun &random_run(const RandSource &rand) {
+    return std::visit([](const auto &source) -> const RandomRun & { return source.run; }, rand);
+}
+RandomRun &random_run(RandSource &rand) {
+    return std::visit([](auto &source) -> RandomRun & { return source.run; }, rand);
+}
+
+/* Where the next choice will be written to / read from.
+
+   Live:     [3,1,4]          --> 3
+   Recorded: [3,1,4] (read 1) --> 1
+ */
+size_t position(const RandSource &rand) {
     struct getter {
-        RandomRun operator()(const Live &l) { return l.run; }
-        RandomRun operator()(const Recorded &r) { return r.run; }
+        size_t operator()(const Live &l) { return l.run.length(); }
+        size_t operator()(const Recorded &r) { return r.run.position(); }
     };
     return std::visit(getter{}, rand);
 }
 
+/* Reads the next choice of a lenient Recorded source (one decoded from fuzzer
+   bytes), which never rejects: a missing choice reads as 0, and an out of
+   range one wraps around into [0,max]. The run is updated to match what was
+   read, so that shrinking starts from valid choices.
+
+   [] (max 10)  --> 0, run [0]
+   [25] (max 10) --> 3, run [3]
+ */
+RAND_TYPE next_lenient(Recorded &r, RAND_TYPE max) {
+    if (r.run.is_exhausted()) { r.run.push_back(0); }
+    RAND_TYPE val = r.run.next();
+    if (val > max) {
+        val %= max + 1;// max + 1 can't overflow: nothing is > UINT_MAX
+        r.run.set_at(r.run.position() - 1, val);
+    }
+    return val;
+}
+
+/* Makes the source continue with the given run.
+
+   Generators that draw several values feed the run returned by one draw into
+   the next one, so that the choices end up one after another in a single
+   RandomRun.
+ */
+void continue_with(RandSource &rand, RandomRun run) {
+    struct continuer {
+        RandomRun run;
+        void operator()(Live &l) { l.run = std::move(run); }
+        void operator()(Recorded &r) { r.run = std::move(run); }
+    };
+    std::visit(continuer{std::move(run)}, rand);
+}
+
 #endif//PBT_RAND_SOURCE_H
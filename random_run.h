@@ -5,6 +5,10 @@
 
 #include <algorithm>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
 #include <vector>
 
 #define MAX_RANDOMRUN_LENGTH (64 * 1024) // 64k items
@@ -12,25 +16,18 @@
 
 class RandomRun {
 public:
-    RandomRun() {
-        run = std::vector<RAND_TYPE>();
-        setup();
-    }
-    RandomRun(const RandomRun &rhs) {
-        run = rhs.run;
-        setup();
-    }
-    RandomRun(const std::vector<RAND_TYPE> &rhs) {
-        run = rhs;
-        setup();
-    }
-    void setup() {
-        // TODO: Is this too wasteful? Should we only do this for Live runs, not for Recorded ones?
-        run.reserve(MAX_RANDOMRUN_LENGTH);
-    }
+    // Runs only take as much memory as they need: generators pass Live runs
+    // along by value, so capacity reserved up front would be lost on the first copy anyway.
+    RandomRun() = default;
+    RandomRun(const RandomRun &rhs) = default;
+    RandomRun(RandomRun &&rhs) noexcept = default;
+    RandomRun &operator=(const RandomRun &rhs) = default;
+    RandomRun &operator=(RandomRun &&rhs) noexcept = default;
+    RandomRun(std::vector<RAND_TYPE> rhs) : run(std::move(rhs)) {}
     [[nodiscard]] bool is_empty() const { return run.empty(); }
     [[nodiscard]] bool is_full() const { return run.size() >= MAX_RANDOMRUN_LENGTH; }
-    bool has_a_chance(Chunk c) {
+    [[nodiscard]] bool is_exhausted() const { return curr_index >= run.size(); }
+    bool has_a_chance(Chunk c) const {
         // size: 6
         // 0 1 2 3 4 5
         //     ^ ^ ^ ^
@@ -40,7 +37,13 @@ public:
     }
     void push_back(RAND_TYPE n) { run.push_back(n); }
     size_t length() const { return run.size(); }
+    size_t position() const { return curr_index; }
+    const std::vector<RAND_TYPE> &choices() const { return run; }
     RAND_TYPE next() { return run[curr_index++]; }
+    // The part of a Recorded run that generators actually read.
+    RandomRun consumed() const {
+        return RandomRun(std::vector<RAND_TYPE>(run.begin(), run.begin() + curr_index));
+    }
     friend std::ostream &operator<<(std::ostream &os, const RandomRun &random_run) {
         auto size = random_run.run.size();
         os << "[";
@@ -70,7 +73,7 @@ public:
                           run.begin() + c.index + c.size,
                           run.end());
     }
-    RandomRun with_deleted(Chunk c) {
+    RandomRun with_deleted(Chunk c) const {
         // TODO bounds checking?
         std::vector<RAND_TYPE> new_run;
         new_run.reserve(run.size() - c.size);
@@ -78,7 +81,7 @@ public:
         new_run.insert(new_run.end(), run.begin(), run.begin() + c.index);
         new_run.insert(new_run.end(), run.begin() + c.index + c.size, run.end());
 
-        return RandomRun(new_run);
+        return RandomRun(std::move(new_run));
     }
 
 private:
@@ -86,4 +89,30 @@ private:
     size_t curr_index = 0;
 };
 
+/* Parses what `operator<<` prints, so that runs can be saved and replayed later.
+
+   "[3,1,4]" -> RandomRun [3,1,4]
+   "[]"      -> RandomRun []
+   "3,1"     -> nothing
+ */
+std::optional<RandomRun> random_run_from_string(const std::string &str) {
+    std::istringstream is(str);
+    char c;
+    if (!(is >> c) || c != '[') { return std::nullopt; }
+    std::vector<RAND_TYPE> choices;
+    if (is >> std::ws && is.peek() == ']') {
+        is.get();
+        return RandomRun(std::move(choices));
+    }
+    while (true) {
+        RAND_TYPE choice;
+        if (!(is >> choice)) { return std::nullopt; }
+        choices.push_back(choice);
+        if (!(is >> c)) { return std::nullopt; }
+        if (c == ']') { break; }
+        if (c != ',') { return std::nullopt; }
+    }
+    return RandomRun(std::move(choices));
+}
+
 #endif//PBT_RANDOM_RUN_H
@@ -0,0 +1,23 @@
+#ifndef PBT_SCOPED_CURRENT_H
+#define PBT_SCOPED_CURRENT_H
+
+/* Points a thread_local "current ..." pointer at `value` for as long as the
+   guard lives, and then restores whatever it pointed at before (so that
+   wrappers like `with_deadline` nest):
+
+   ScopedCurrent<const Deadline> guard(current_deadline, &deadline);
+ */
+template<typename T>
+class ScopedCurrent {
+public:
+    ScopedCurrent(T *&current, T *value) : current(current), previous(current) { current = value; }
+    ~ScopedCurrent() { current = previous; }
+    ScopedCurrent(const ScopedCurrent &) = delete;
+    ScopedCurrent &operator=(const ScopedCurrent &) = delete;
+
+private:
+    T *&current;
+    T *previous;
+};
+
+#endif//PBT_SCOPED_CURRENT_H
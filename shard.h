@@ -0,0 +1,234 @@
+#ifndef PBT_SHARD_H
+#define PBT_SHARD_H
+
+#include "random_run.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Settings shared by all the properties run by this process. See `parse_run_args`. */
+struct RunConfig {
+    std::optional<uint64_t> seed;// random per run() if not given
+    unsigned int shard_index = 0;
+    unsigned int shard_count = 1;
+    std::string failures_path;            // where failures get written to, if anywhere
+    std::vector<std::string> merge_paths; // failure files of other shards, to merge instead of running tests
+};
+
+RunConfig run_config;
+
+/* Each test case gets its own RNG, derived from the seed and the case index
+   only. That way case #17 generates the same values no matter which shard
+   (or how many shards) it runs in.
+ */
+std::mt19937 case_rng(uint64_t seed, int case_index) {
+    std::seed_seq seq{(uint32_t) seed, (uint32_t) (seed >> 32), (uint32_t) case_index};
+    return std::mt19937(seq);
+}
+
+/* The seed of this run() (or run_batch(), ...): the --seed given, or a random
+   one. Failures report it (see `FailsWith::seed`), so they can be rerun.
+ */
+uint64_t run_seed() {
+    if (run_config.seed) { return *run_config.seed; }
+    return std::random_device{}();
+}
+
+bool in_this_shard(int case_index) {
+    return (unsigned int) case_index % run_config.shard_count == run_config.shard_index;
+}
+
+// The whole string has to be a number, "12abc" doesn't parse.
+template<typename N>
+std::optional<N> parse_number(std::string_view str) {
+    N n{};
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), n);
+    if (error != std::errc() || end != str.data() + str.size()) { return std::nullopt; }
+    return n;
+}
+
+/* A shrunk failure, as written by a shard:
+
+   <test name> \t <case index> \t <RandomRun> \t <error>
+
+   Tabs, newlines and backslashes in the name and the error are escaped (see
+   `escape_field`), so each failure stays on a single line.
+ */
+struct ShardFailure {
+    std::string test_name;
+    int case_index;
+    RandomRun run;
+    std::string error;
+};
+
+// "a\tb\nc\\d" --> "a\\tb\\nc\\\\d"
+std::string escape_field(const std::string &field) {
+    std::string escaped;
+    escaped.reserve(field.size());
+    for (char c: field) {
+        switch (c) {
+            case '\\': escaped += "\\\\"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+std::string unescape_field(const std::string &field) {
+    std::string unescaped;
+    unescaped.reserve(field.size());
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] != '\\' || i + 1 == field.size()) {
+            unescaped += field[i];
+            continue;
+        }
+        switch (field[++i]) {
+            case 't': unescaped += '\t'; break;
+            case 'n': unescaped += '\n'; break;
+            case 'r': unescaped += '\r'; break;
+            default: unescaped += field[i];// including the backslash itself
+        }
+    }
+    return unescaped;
+}
+
+// Appends to the failures file; `parse_run_args` truncates it at startup.
+void write_shard_failure(const ShardFailure &failure) {
+    if (run_config.failures_path.empty()) { return; }
+    std::ofstream file(run_config.failures_path, std::ios::app);
+    file << escape_field(failure.test_name) << '\t' << failure.case_index << '\t' << failure.run << '\t'
+         << escape_field(failure.error) << '\n';
+}
+
+std::vector<ShardFailure> read_shard_failures(const std::string &path) {
+    std::vector<ShardFailure> failures;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream is(line);
+        std::string name, case_index, run, error;
+        if (!std::getline(is, name, '\t') || !std::getline(is, case_index, '\t') || !std::getline(is, run, '\t')) {
+            continue;
+        }
+        std::getline(is, error);
+        auto parsed_case_index = parse_number<int>(case_index);
+        auto parsed_run = random_run_from_string(run);
+        if (!parsed_case_index || !parsed_run) { continue; }
+        failures.push_back(ShardFailure{unescape_field(name), *parsed_case_index, *parsed_run, unescape_field(error)});
+    }
+    return failures;
+}
+
+/* Picks one failure per test: the one from the earliest test case.
+
+   That's the failure a single, unsharded run would have stopped at (and
+   shrunk the same way), so the merged result doesn't depend on the number of
+   shards. Picking the smallest shrunk run instead would.
+ */
+std::map<std::string, ShardFailure> merge_shard_failures(const std::vector<ShardFailure> &failures) {
+    std::map<std::string, ShardFailure> merged;
+    for (const auto &failure: failures) {
+        auto it = merged.find(failure.test_name);
+        if (it == merged.end()) {
+            merged.emplace(failure.test_name, failure);
+        } else if (failure.case_index < it->second.case_index) {
+            it->second = failure;
+        }
+    }
+    return merged;
+}
+
+void print_merged_shard_failures(const std::vector<std::string> &paths) {
+    std::vector<ShardFailure> all;
+    for (const auto &path: paths) {
+        auto failures = read_shard_failures(path);
+        all.insert(all.end(), failures.begin(), failures.end());
+    }
+    for (const auto &[name, failure]: merge_shard_failures(all)) {
+        std::cout << "[" << name << "] Fails at case #" << failure.case_index << ":"
+                  << "\n - RandomRun: " << failure.run
+                  << "\n - error: \"" << failure.error << "\"" << std::endl;
+    }
+}
+
+/* Understands:
+
+   --seed <n>         seed all test cases are derived from
+   --shard <i>/<n>    only run test cases i, i+n, i+2n, ... (needs --seed);
+                      failures get written to pbt-shard-<i>-of-<n>.txt
+   --failures <path>  write failures to this file instead
+                      (either way, the file is emptied first)
+   --merge <paths...> print the merged failures of all shards and exit
+
+   Returns false (after printing why) if the arguments don't make sense.
+ */
+bool parse_run_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--seed" && has_value) {
+            std::string seed = argv[++i];
+            run_config.seed = parse_number<uint64_t>(seed);
+            if (!run_config.seed) {
+                std::cerr << "--seed expects a number, got: " << seed << std::endl;
+                return false;
+            }
+        } else if (arg == "--shard" && has_value) {
+            std::string_view shard = argv[++i];
+            auto slash = shard.find('/');
+            auto index = parse_number<unsigned int>(shard.substr(0, slash));
+            auto count = slash == std::string_view::npos ? std::nullopt : parse_number<unsigned int>(shard.substr(slash + 1));
+            if (!index || !count) {
+                std::cerr << "--shard expects <i>/<n>, got: " << shard << std::endl;
+                return false;
+            }
+            run_config.shard_index = *index;
+            run_config.shard_count = *count;
+        } else if (arg == "--failures" && has_value) {
+            run_config.failures_path = argv[++i];
+        } else if (arg == "--merge") {
+            while (i + 1 < argc) { run_config.merge_paths.emplace_back(argv[++i]); }
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (run_config.shard_count == 0 || run_config.shard_index >= run_config.shard_count) {
+        std::cerr << "--shard expects 0 <= i < n" << std::endl;
+        return false;
+    }
+    if (run_config.shard_count > 1) {
+        if (!run_config.seed) {
+            std::cerr << "--shard needs a --seed shared by all the shards" << std::endl;
+            return false;
+        }
+        if (run_config.failures_path.empty()) {
+            run_config.failures_path = "pbt-shard-" + std::to_string(run_config.shard_index) +
+                                       "-of-" + std::to_string(run_config.shard_count) + ".txt";
+        }
+    }
+    if (!run_config.failures_path.empty() && run_config.merge_paths.empty()) {
+        // Start from scratch: failures from an earlier run (maybe with another seed) mustn't get merged
+        std::ofstream truncate(run_config.failures_path, std::ios::trunc);
+        if (!truncate) {
+            std::cerr << "Can't write failures to: " << run_config.failures_path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif//PBT_SHARD_H
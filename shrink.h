@@ -8,8 +8,13 @@
 #include "test_exception.h"
 #include "test_result.h"
 #include "shrink_cmd.h"
+#include "shrink_profile.h"
 
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <optional>
 #include <string>
 #include <variant>
 #include <vector>
@@ -24,145 +29,246 @@ struct ShrinkState {
 template<typename T>
 struct ShrinkResult {
     bool was_improvement;
-    ShrinkState<T> state;
+    std::optional<ShrinkState<T>> state;// only there if it was an improvement
+};
+
+/* Every distinct failure (keyed by its message) we've come across, with the
+   smallest RandomRun we've seen it fail with.
+
+   Failures that have been shrunk already are marked as minimized; we don't
+   bother recording smaller runs for them anymore.
+ */
+template<typename T>
+struct FailureRegistry {
+    struct Entry {
+        std::optional<ShrinkState<T>> pending;// smallest one seen, until someone takes it to shrink it
+        bool minimized;
+    };
+    std::map<std::string, Entry> by_message;
+    std::vector<std::string> order;// messages in the order we found them
+
+    void record(ShrinkState<T> state) {
+        auto it = by_message.find(state.fail_message);
+        if (it == by_message.end()) {
+            order.push_back(state.fail_message);
+            std::string message = state.fail_message;
+            by_message.emplace(std::move(message), Entry{std::move(state), false});
+        } else if (!it->second.minimized && (!it->second.pending || state.run < it->second.pending->run)) {
+            it->second.pending = std::move(state);
+        }
+    }
+    [[nodiscard]] bool is_minimized(const std::string &message) const {
+        auto it = by_message.find(message);
+        return it != by_message.end() && it->second.minimized;
+    }
+    FailsWith<T> mark_minimized(ShrinkState<T> state, bool fully_shrunk) {
+        if (!by_message.contains(state.fail_message)) {
+            order.push_back(state.fail_message);
+        }
+        by_message[state.fail_message] = Entry{std::nullopt, true};
+        return FailsWith<T>{std::move(state.value), std::move(state.fail_message), std::move(state.run), fully_shrunk};
+    }
+    std::optional<ShrinkState<T>> take_next_to_minimize() {
+        for (const auto &message: order) {
+            Entry &entry = by_message.at(message);
+            if (!entry.minimized && entry.pending) {
+                std::optional<ShrinkState<T>> next = std::move(entry.pending);
+                entry.pending.reset();
+                return next;
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+/* Limits on how much work `shrink()` may do. Zero means no limit.
+
+   When the budget runs out, `shrink()` returns the best counterexample found
+   so far, marked as not fully shrunk; shrinking can be picked up again later
+   with `resume()`.
+ */
+struct ShrinkBudget {
+    uint64_t max_test_calls = 0;
+    std::chrono::milliseconds max_time{0};
+};
+
+ShrinkBudget shrink_budget;
+
+/* Things the shrinker threads through all its steps.
+
+   `profile` and `stats` are only given when profiling (see `shrink_profiling`).
+
+   When `failures` is given, only a failure with the same message counts as an
+   improvement: other failures are recorded there instead of letting the
+   shrinker slip from one bug to another.
+ */
+template<typename T>
+struct ShrinkContext {
+    ShrinkProfile *profile = nullptr;
+    CmdStats *stats = nullptr;// row of the ShrinkCmd currently running
+    FailureRegistry<T> *failures = nullptr;
+
+    ShrinkBudget budget;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    uint64_t test_calls = 0;
+
+    [[nodiscard]] bool out_of_budget() const {
+        if (budget.max_test_calls > 0 && test_calls >= budget.max_test_calls) { return true; }
+        if (budget.max_time.count() > 0 && std::chrono::steady_clock::now() - started >= budget.max_time) { return true; }
+        return false;
+    }
 };
 
 // Shrinker
 
+/* ShrinkStates (and the values in them) are passed around by reference and
+   only ever moved, never copied: values can be large (or move-only), and the
+   shrinker goes through a lot of candidates.
+ */
+
 template<typename T>
-ShrinkResult<T> no_improvement(ShrinkState<T> state) {
-    return ShrinkResult<T>{false, state};
+ShrinkResult<T> no_improvement() {
+    return ShrinkResult<T>{false, std::nullopt};
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> keep_if_better(RandomRun new_run, ShrinkState<T> state, Generator<T> generator, FN test_function) {
-    if (new_run < state.run) {
-        Recorded recorded_source = Recorded{new_run};
-        GenResult<T> gen_result = generator(recorded_source);
-        
+ShrinkResult<T> keep_if_better(RandomRun new_run, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
+    CmdStats *stats = ctx.stats;
+    if (new_run < state.run && !ctx.out_of_budget()) {
+        auto gen_start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        GenResult<T> gen_result = generator(Recorded{new_run});
+        if (stats) {
+            stats->attempts++;
+            stats->gen_ns += ns_since(gen_start);
+        }
+
         if (auto generated = std::get_if<Generated<T>>(&gen_result)) {
+            auto test_start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            ctx.test_calls++;
             try {
                 test_function(generated->value);
             } catch (TestException &e) {
-                return ShrinkResult<T>{true, ShrinkState<T>{new_run, generated->value, e.what()}};
+                std::string message = e.what();
+                if (stats) { stats->test_ns += ns_since(test_start); }
+                if (ctx.failures && message != state.fail_message) {
+                    // A different bug: note it down for later, but keep shrinking this one
+                    ctx.failures->record(ShrinkState<T>{std::move(new_run), std::move(generated->value), std::move(message)});
+                    return no_improvement<T>();
+                }
+                if (stats) { stats->improvements++; }
+                return ShrinkResult<T>{true, ShrinkState<T>{std::move(new_run), std::move(generated->value), std::move(message)}};
             }
+            if (stats) { stats->test_ns += ns_since(test_start); }
+        } else if (stats) {
+            stats->rejections++;
         }
     }
-    return no_improvement(state);
+    return no_improvement<T>();
 }
 
 template<typename T, typename FN, typename SET_FN>
-ShrinkResult<T> binary_shrink(RAND_TYPE low, RAND_TYPE high, SET_FN update_run, ShrinkState<T> state, Generator<T> generator, FN test_function) {
+ShrinkResult<T> binary_shrink(RAND_TYPE low, RAND_TYPE high, SET_FN update_run, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
     // Let's try with the best case first
     RandomRun run_with_low = update_run(low, state.run);
-    ShrinkResult<T> after_low = keep_if_better(run_with_low, state, generator, test_function);
+    ShrinkResult<T> after_low = keep_if_better(std::move(run_with_low), state, generator, test_function, ctx);
     if (after_low.was_improvement) {
         // We can't do any better
         return after_low;
     }
     // Gotta do the loop!
-    ShrinkResult<T> result = after_low;
+    ShrinkResult<T> result = std::move(after_low);
     while (low + 1 < high) {
         // TODO: do the average in a safer way?
         // https://stackoverflow.com/questions/24920503/what-is-the-right-way-to-find-the-average-of-two-values
         RAND_TYPE mid = low + (high - low) / 2;
-        RandomRun run_with_mid = update_run(mid, state.run);
-        ShrinkResult<T> after_mid = keep_if_better(run_with_mid, state, generator, test_function);
+        const ShrinkState<T> &best = result.was_improvement ? *result.state : state;
+        RandomRun run_with_mid = update_run(mid, best.run);
+        ShrinkResult<T> after_mid = keep_if_better(std::move(run_with_mid), best, generator, test_function, ctx);
         if (after_mid.was_improvement) {
             high = mid;
+            // Any improvement along the way counts, not just the last step
+            result = std::move(after_mid);
         } else {
             low = mid;
         }
-        result = after_mid;
-        state = after_mid.state;
     }
     return result;
     
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> shrink_zero(ZeroChunk c, ShrinkState<T> state, Generator<T> generator, FN test_function) {
-    // TODO do we need to copy? or is it done automatically
-    RandomRun new_run = state.run;
-    std::cout << "Run before zeroing: " << new_run << std::endl;
-    std::cout << "TODO: we need to figure out if we need to copy here." << std::endl;
+ShrinkResult<T> shrink_zero(ZeroChunk c, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
+    RandomRun new_run = state.run;// the current best run has to stay intact
     size_t end = c.chunk.index + c.chunk.size;
     for (size_t i = c.chunk.index; i < end; i++) {
         new_run[i] = 0;
     }
-    std::cout << "Run after zeroing: " << new_run << std::endl;
-    std::cout << "TODO: is it any different from the following, original state.run?" << std::endl;
-    std::cout << "state.run: " << state.run << std::endl;
-    return keep_if_better(new_run, state, generator, test_function);
+    return keep_if_better(std::move(new_run), state, generator, test_function, ctx);
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> shrink_sort(SortChunk c, ShrinkState<T> state, Generator<T> generator, FN test_function) {
-    // TODO do we need to copy? or is it done automatically
-    RandomRun new_run = state.run;
-    std::cout << "Run before sorting: " << new_run << std::endl;
-    std::cout << "TODO: we need to figure out if we need to copy here." << std::endl;
+ShrinkResult<T> shrink_sort(SortChunk c, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
+    RandomRun new_run = state.run;// the current best run has to stay intact
     new_run.sort_chunk(c.chunk);
-    std::cout << "Run after sorting: " << new_run << std::endl;
-    std::cout << "TODO: is it any different from the following, original state.run?" << std::endl;
-    std::cout << "state.run: " << state.run << std::endl;
-    return keep_if_better(new_run, state, generator, test_function);
+    return keep_if_better(std::move(new_run), state, generator, test_function, ctx);
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> shrink_delete(DeleteChunkAndMaybeDecPrevious c, ShrinkState<T> state, Generator<T> generator, FN test_function) {
+ShrinkResult<T> shrink_delete(DeleteChunkAndMaybeDecPrevious c, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
     RandomRun run_deleted = state.run.with_deleted(c.chunk);
     RandomRun run_decremented = run_deleted;
-    run_decremented[c.chunk.index - 1]--;
+    if (c.chunk.index > 0) { // there's no previous choice to decrement otherwise
+        run_decremented[c.chunk.index - 1]--;
+    }
     
-    ShrinkResult<T> after_dec = keep_if_better(run_decremented, state, generator, test_function);
+    ShrinkResult<T> after_dec = keep_if_better(run_decremented, state, generator, test_function, ctx);
     if (after_dec.was_improvement) {
         return after_dec;
     }
     if (run_deleted == run_decremented) {
         return after_dec;
     }
-    return keep_if_better(run_deleted, state, generator, test_function);
+    return keep_if_better(std::move(run_deleted), state, generator, test_function, ctx);
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> shrink_minimize(MinimizeChoice c, ShrinkState<T> state, Generator<T> generator, FN test_function) {
-    RandomRun new_run = state.run;
-    RAND_TYPE value = state.run[c.index];
+ShrinkResult<T> shrink_minimize(MinimizeChoice c, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
+    RAND_TYPE value = state.run.at(c.index);
     if (value == 0) {
-        return no_improvement(state);
+        return no_improvement<T>();
     } else {
         return binary_shrink(0,
                              value,
-                             [c](RAND_TYPE new_value, RandomRun run){
+                             [c](RAND_TYPE new_value, const RandomRun &run){
                                 RandomRun new_run = run;
                                 new_run.set_at(c.index,new_value);
                                 return new_run;
                              },
                              state,
                              generator,
-                             test_function);
+                             test_function,
+                             ctx);
     }
 }
 
 template<typename T, typename FN>
-ShrinkResult<T> shrink_with_cmd(ShrinkCmd cmd, ShrinkState<T> state, Generator<T> generator, FN test_function) {
+ShrinkResult<T> shrink_with_cmd(ShrinkCmd cmd, const ShrinkState<T> &state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
     struct handler {
-        ShrinkState<T> state;
-        Generator<T> generator;
-        FN test_function;
-        explicit handler(ShrinkState<T> state, Generator<T> generator, FN test_function) : state(state), generator(generator), test_function(test_function) {}
-
-        ShrinkResult<T> operator()(ZeroChunk c)                      { return shrink_zero(c, state, generator, test_function); }
-        ShrinkResult<T> operator()(SortChunk c)                      { return shrink_sort(c, state, generator, test_function); }
-        ShrinkResult<T> operator()(DeleteChunkAndMaybeDecPrevious c) { return shrink_delete(c, state, generator, test_function); }
-        ShrinkResult<T> operator()(MinimizeChoice c)                 { return shrink_minimize(c, state, generator, test_function); }
+        const ShrinkState<T> &state;
+        const Generator<T> &generator;
+        FN &test_function;
+        ShrinkContext<T> &ctx;
+
+        ShrinkResult<T> operator()(ZeroChunk c)                      { return shrink_zero(c, state, generator, test_function, ctx); }
+        ShrinkResult<T> operator()(SortChunk c)                      { return shrink_sort(c, state, generator, test_function, ctx); }
+        ShrinkResult<T> operator()(DeleteChunkAndMaybeDecPrevious c) { return shrink_delete(c, state, generator, test_function, ctx); }
+        ShrinkResult<T> operator()(MinimizeChoice c)                 { return shrink_minimize(c, state, generator, test_function, ctx); }
     };
-    return std::visit(handler{state, generator, test_function}, cmd);
+    return std::visit(handler{state, generator, test_function, ctx}, cmd);
 }
 
 template<typename T, typename FN>
-ShrinkState<T> shrink_once(ShrinkState<T> state, Generator<T> generator, FN test_function) {
+ShrinkState<T> shrink_once(ShrinkState<T> state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
     auto cmds = shrink_cmds(state.run);
     for (ShrinkCmd cmd: cmds) {
         /* We're keeping the list of ShrinkCmds we generated from the initial
@@ -178,32 +284,58 @@ ShrinkState<T> shrink_once(ShrinkState<T> state, Generator<T> generator, FN test
         if (!has_a_chance(cmd, state.run)) {
             continue;
         }
-        ShrinkResult<T> result = shrink_with_cmd(cmd, state, generator, test_function);
+        if (ctx.out_of_budget()) {
+            break;
+        }
+        ctx.stats = ctx.profile ? &ctx.profile->row_for(cmd) : nullptr;
+        auto cmd_start = ctx.stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        ShrinkResult<T> result = shrink_with_cmd(cmd, state, generator, test_function, ctx);
+        if (ctx.stats) { ctx.stats->total_ns += ns_since(cmd_start); }
         if (result.was_improvement) {
-            std::cout << "Shrunk with " << shrink_cmd_to_string(cmd) << ": " << result.state.run << std::endl;
-            state = result.state;
+            std::cout << "Shrunk with " << shrink_cmd_to_string(cmd) << ": " << result.state->run << std::endl;
+            state = std::move(*result.state);
         }
     }
     return state;
 }
 
 template<typename T, typename FN>
-FailsWith<T> shrink(Generated<T> generated, Generator<T> generator, FN test_function, std::string fail_message) {
+ShrinkState<T> shrink_state(ShrinkState<T> state, const Generator<T> &generator, FN &test_function, ShrinkContext<T> &ctx) {
+    while (true) {
+        RandomRun before = state.run;
+        state = shrink_once(std::move(state), generator, test_function, ctx);
+        if (state.run == before || ctx.out_of_budget()) {
+            return state;
+        }
+    }
+}
+
+/* `failures` is only given when looking for all distinct failures (see
+   `run_distinct()`): failures with other messages found along the way are
+   recorded there, and the result is marked as minimized in it.
+ */
+template<typename T, typename FN>
+FailsWith<T> shrink(Generated<T> generated, Generator<T> generator, FN test_function, std::string fail_message,
+                    FailureRegistry<T> *failures = nullptr) {
     std::cout << "Let's shrink: " << generated.value << std::endl;
     std::cout << "Original RandomRun: " << generated.run << std::endl;
 
-    if (generated.run.is_empty()) {// We can't do any better
-        return FailsWith<T>{generated.value, fail_message};
+    ShrinkState<T> state{std::move(generated.run), std::move(generated.value), std::move(fail_message)};
+    bool fully_shrunk = true;
+    if (!state.run.is_empty()) {// We can't do any better otherwise
+        ShrinkProfile profile;
+        ShrinkContext<T> ctx{shrink_profiling ? &profile : nullptr, nullptr, failures, shrink_budget};
+        state = shrink_state(std::move(state), generator, test_function, ctx);
+        fully_shrunk = !ctx.out_of_budget();
+        if (ctx.profile) {
+            print_shrink_profile(profile);
+        }
     }
 
-    ShrinkState<T> new_state{generated.run, generated.value, fail_message};
-    ShrinkState<T> current_state;
-    do {
-        current_state = new_state;
-        new_state = shrink_once(current_state, generator, test_function);
-    } while (new_state.run != current_state.run);
-
-    return FailsWith<T>{new_state.value, new_state.fail_message};
+    if (failures) {
+        return failures->mark_minimized(std::move(state), fully_shrunk);
+    }
+    return FailsWith<T>{std::move(state.value), std::move(state.fail_message), std::move(state.run), fully_shrunk};
 }
 
 #endif//PBT_SHRINK_H
@@ -116,7 +116,7 @@ std::vector<ShrinkCmd> zero_cmds(size_t length) {
             [](Chunk c) { return ZeroChunk{c}; });
 }
 
-std::vector<ShrinkCmd> shrink_cmds(RandomRun r) {
+std::vector<ShrinkCmd> shrink_cmds(const RandomRun &r) {
     size_t length = r.length();
     
     std::vector<std::vector<ShrinkCmd>> all;
@@ -129,10 +129,10 @@ std::vector<ShrinkCmd> shrink_cmds(RandomRun r) {
     return std::vector<ShrinkCmd>(joined.begin(), joined.end());
 }
 
-bool has_a_chance(ShrinkCmd cmd, RandomRun run) {
+bool has_a_chance(ShrinkCmd cmd, const RandomRun &run) {
     struct predicate {
-        RandomRun &run;
-        explicit predicate(RandomRun &run) : run(run) {}
+        const RandomRun &run;
+        explicit predicate(const RandomRun &run) : run(run) {}
 
         bool operator()(ZeroChunk c) { return run.has_a_chance(c.chunk); }
         bool operator()(SortChunk c) { return run.has_a_chance(c.chunk); }
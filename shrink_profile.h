@@ -0,0 +1,72 @@
+#ifndef PBT_SHRINK_PROFILE_H
+#define PBT_SHRINK_PROFILE_H
+
+#include "shrink_cmd.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+
+/* Set to true to get a per-ShrinkCmd report at the end of every `shrink()`.
+   Off by default, as it adds two clock reads to every shrink attempt.
+ */
+bool shrink_profiling = false;
+
+struct CmdStats {
+    uint64_t attempts = 0;    // candidates we ran the generator on
+    uint64_t improvements = 0;// candidates that still failed the test (and so were kept)
+    uint64_t rejections = 0;  // candidates the generator rejected
+    uint64_t gen_ns = 0;      // time spent in the generator
+    uint64_t test_ns = 0;     // time spent in the test function
+    uint64_t total_ns = 0;    // time spent in the cmd overall, incl. building candidates
+};
+
+struct cmd_kind_getter {
+    std::pair<std::string, int> operator()(ZeroChunk c)                      { return {"ZeroChunk", c.chunk.size}; }
+    std::pair<std::string, int> operator()(SortChunk c)                      { return {"SortChunk", c.chunk.size}; }
+    std::pair<std::string, int> operator()(DeleteChunkAndMaybeDecPrevious c) { return {"DeleteChunkAndMaybeDecPrevious", c.chunk.size}; }
+    std::pair<std::string, int> operator()(MinimizeChoice)                   { return {"MinimizeChoice", 1}; }
+};
+
+/* Stats per ShrinkCmd kind and chunk size, eg. ("SortChunk", 4). */
+struct ShrinkProfile {
+    std::map<std::pair<std::string, int>, CmdStats> rows;
+
+    CmdStats &row_for(ShrinkCmd cmd) {
+        return rows[std::visit(cmd_kind_getter{}, cmd)];
+    }
+};
+
+uint64_t ns_since(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void print_shrink_profile(const ShrinkProfile &profile) {
+    auto ms = [](uint64_t ns) { return std::to_string(ns / 1000000) + "." + std::to_string(ns / 100000 % 10); };
+    std::cout << "Shrink profile:" << std::endl;
+    std::cout << std::left << std::setw(32) << "cmd" << std::right
+              << std::setw(6) << "size"
+              << std::setw(10) << "attempts"
+              << std::setw(10) << "improved"
+              << std::setw(10) << "rejected"
+              << std::setw(12) << "gen ms"
+              << std::setw(12) << "test ms"
+              << std::setw(12) << "total ms" << std::endl;
+    for (const auto &[key, stats]: profile.rows) {
+        std::cout << std::left << std::setw(32) << key.first << std::right
+                  << std::setw(6) << key.second
+                  << std::setw(10) << stats.attempts
+                  << std::setw(10) << stats.improvements
+                  << std::setw(10) << stats.rejections
+                  << std::setw(12) << ms(stats.gen_ns)
+                  << std::setw(12) << ms(stats.test_ns)
+                  << std::setw(12) << ms(stats.total_ns) << std::endl;
+    }
+}
+
+#endif//PBT_SHRINK_PROFILE_H
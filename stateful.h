@@ -0,0 +1,240 @@
+#ifndef PBT_STATEFUL_H
+#define PBT_STATEFUL_H
+
+#include "gen_result.h"
+#include "generator.h"
+#include "pbt.h"
+#include "rand_source.h"
+#include "random_run.h"
+#include "test_exception.h"
+#include "test_result.h"
+
+#include <concepts>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define MAX_COMMANDS_PER_TEST 50
+
+/* A sequence of commands, along with the choices that generated it.
+
+   `ends[i]` is the position in `choices` right after command `i` was drawn.
+   Two sequences whose choices agree up to `ends[i]` have the same first
+   `i + 1` commands, which is what lets the runner resume from snapshots.
+ */
+template<typename Cmd>
+struct Commands {
+    std::vector<Cmd> commands;
+    std::vector<size_t> ends;
+    std::vector<RAND_TYPE> choices;
+};
+
+template<typename Cmd>
+std::ostream &operator<<(std::ostream &os, const Commands<Cmd> &cmds) {
+    os << "[";
+    for (size_t i = 0; i < cmds.commands.size(); i++) {
+        os << cmds.commands[i];
+        if (i < cmds.commands.size() - 1) { os << ","; }
+    }
+    os << "]";
+    return os;
+}
+
+template<typename Cmd>
+std::string to_string(const Commands<Cmd> &cmds) {
+    std::ostringstream os;
+    os << cmds;
+    return os.str();
+}
+
+namespace Gen {
+
+    /* Generates a sequence of at most `max_commands` commands, all of them in
+       the same RandomRun. Each command is preceded by a "continue?" choice
+       where 0 means "stop here":
+
+       Gen::commands(Gen::unsigned_int(9), 5) -> value [4,2],  RandomRun [3,4,6,2,0]
+                                              -> value [],     RandomRun [0]
+                                              etc.
+
+       Shrinks towards fewer commands (deleting a command deletes its chunk of
+       the RandomRun) and towards simpler commands.
+     */
+    template<typename Cmd>
+    Generator<Commands<Cmd>> commands(Generator<Cmd> command, unsigned int max_commands) {
+        // 1 in 8 chance to stop after each command
+        Generator<unsigned int> more = Gen::unsigned_int(7);
+        return Generator<Commands<Cmd>>([command, more, max_commands](RandSource source) {
+            Commands<Cmd> result;
+            for (unsigned int i = 0; i < max_commands; i++) {
+                GenResult<unsigned int> more_result = more(std::move(source));
+                if (auto r = std::get_if<Rejected>(&more_result)) {
+                    return rejected<Commands<Cmd>>(r->reason);
+                }
+                auto &more_generated = std::get<Generated<unsigned int>>(more_result);
+                continue_with(source, std::move(more_generated.run));
+                if (more_generated.value == 0) {
+                    break;
+                }
+                GenResult<Cmd> cmd_result = command(std::move(source));
+                if (auto r = std::get_if<Rejected>(&cmd_result)) {
+                    return rejected<Commands<Cmd>>(r->reason);
+                }
+                auto &cmd_generated = std::get<Generated<Cmd>>(cmd_result);
+                continue_with(source, std::move(cmd_generated.run));
+                result.commands.push_back(std::move(cmd_generated.value));
+                result.ends.push_back(position(source));
+            }
+            RandomRun run = std::move(random_run(source));
+            result.choices = run.choices();
+            return generated(std::move(run), std::move(result));
+        });
+    }
+
+}// namespace Gen
+
+/* Describes a stateful system under test and the model we check it against.
+
+   `run_command` applies the command to both the model and the system and
+   throws a TestException if they disagree.
+
+   With `snapshots` on, the runner keeps copies of the model and the system at
+   every command boundary of the current smallest failing sequence. A shrink
+   candidate that starts with the same commands resumes from the last shared
+   snapshot instead of replaying them all from scratch. This only pays off if
+   copying the model and the system is cheaper than running the commands.
+
+   Snapshots need both Model and System to be copyable. Systems that aren't
+   (holding sockets, handles, unique_ptrs, ...) still work, but `snapshots` is
+   ignored for them and every candidate replays from scratch.
+ */
+template<typename Model, typename System, typename Cmd>
+struct StateMachine {
+    Generator<Cmd> command;
+    std::function<Model()> init_model;
+    std::function<System()> init_system;
+    std::function<void(const Cmd &, Model &, System &)> run_command;
+    unsigned int max_commands = MAX_COMMANDS_PER_TEST;
+    bool snapshots = false;
+};
+
+template<typename Model, typename System>
+constexpr bool can_snapshot = std::copy_constructible<Model> && std::copy_constructible<System>;
+
+struct StatefulStats {
+    size_t commands_run = 0;    // commands actually executed
+    size_t commands_skipped = 0;// commands we didn't need to execute thanks to snapshots
+};
+
+template<typename Model, typename System>
+struct Snapshot {
+    size_t end;// position in the choices right after the last command applied
+    Model model;
+    System system;
+};
+
+/* Snapshots of the smallest failing command sequence seen so far.
+
+   Any failing sequence the test function sees is accepted by the shrinker
+   (`keep_if_better` only tries runs smaller than the current one), so on each
+   failure we simply replace the snapshots with the ones from that sequence.
+ */
+template<typename Model, typename System>
+struct SnapshotCache {
+    using SnapshotPtr = std::shared_ptr<const Snapshot<Model, System>>;
+
+    std::vector<RAND_TYPE> choices;
+    std::vector<SnapshotPtr> snapshots;// one per command boundary, in order
+    StatefulStats stats;
+
+    // How many of the cached snapshots are valid for the given choices.
+    size_t shared_snapshots(const std::vector<RAND_TYPE> &new_choices) const {
+        size_t common = 0;
+        while (common < choices.size() && common < new_choices.size() && choices[common] == new_choices[common]) {
+            common++;
+        }
+        size_t count = 0;
+        while (count < snapshots.size() && snapshots[count]->end <= common) {
+            count++;
+        }
+        return count;
+    }
+};
+
+template<typename Model, typename System, typename Cmd>
+TestResult<Commands<Cmd>> run_stateful(StateMachine<Model, System, Cmd> machine,
+                                       std::shared_ptr<SnapshotCache<Model, System>> cache = nullptr) {
+    if (!cache) { cache = std::make_shared<SnapshotCache<Model, System>>(); }
+    using SnapshotPtr = typename SnapshotCache<Model, System>::SnapshotPtr;
+
+    auto test_function = [machine, cache](const Commands<Cmd> &cmds) {
+        std::vector<SnapshotPtr> taken;
+        size_t first = 0;
+        std::optional<Model> model;
+        std::optional<System> system;
+        if constexpr (can_snapshot<Model, System>) {
+            if (machine.snapshots) {
+                size_t shared = cache->shared_snapshots(cmds.choices);
+                taken.assign(cache->snapshots.begin(), cache->snapshots.begin() + shared);
+            }
+            if (!taken.empty()) {
+                // Resume right after the commands the last shared snapshot has already applied
+                const auto &resume = taken.back();
+                while (first < cmds.ends.size() && cmds.ends[first] <= resume->end) { first++; }
+                model.emplace(resume->model);
+                system.emplace(resume->system);
+                taken.pop_back();// will be taken again (for free) below
+                cache->stats.commands_skipped += first;
+            }
+        }
+        if (!model) {
+            model.emplace(machine.init_model());
+            system.emplace(machine.init_system());
+        }
+
+        for (size_t i = first; i < cmds.commands.size(); i++) {
+            if constexpr (can_snapshot<Model, System>) {
+                if (machine.snapshots) {
+                    if (i == first && first > 0) {
+                        // Same state as the snapshot we resumed from
+                        taken.push_back(cache->snapshots[taken.size()]);
+                    } else {
+                        size_t end = i == 0 ? 0 : cmds.ends[i - 1];
+                        taken.push_back(std::make_shared<const Snapshot<Model, System>>(Snapshot<Model, System>{end, *model, *system}));
+                    }
+                }
+            }
+            cache->stats.commands_run++;
+            try {
+                machine.run_command(cmds.commands[i], *model, *system);
+            } catch (TestException &) {
+                if (machine.snapshots) {
+                    cache->choices = cmds.choices;
+                    cache->snapshots = std::move(taken);
+                }
+                throw;
+            }
+        }
+    };
+
+    return run(Gen::commands(machine.command, machine.max_commands), test_function);
+}
+
+template<typename Model, typename System, typename Cmd>
+void run_stateful_test(const std::string &name, StateMachine<Model, System, Cmd> machine) {
+    std::cout << "--------" << std::endl;
+    auto cache = std::make_shared<SnapshotCache<Model, System>>();
+    auto result = run_stateful(machine, cache);
+    std::cout << "[" << name << "] " << to_string(result) << std::endl;
+    write_shard_failure(name, result);
+    std::cout << " - commands run: " << cache->stats.commands_run
+              << ", skipped thanks to snapshots: " << cache->stats.commands_skipped << std::endl;
+}
+
+#endif//PBT_STATEFUL_H
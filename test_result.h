@@ -1,8 +1,13 @@
 #ifndef PBT_TEST_RESULT_H
 #define PBT_TEST_RESULT_H
 
+#include "random_run.h"
+
 #include <algorithm>
+#include <cstdint>
 #include <map>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <variant>
@@ -14,6 +19,10 @@ template<typename T>
 struct FailsWith {
     T value;
     std::string error;
+    RandomRun run;            // run corresponding to the value, can be replayed with `resume()`
+    bool fully_shrunk = true; // false if shrinking ran out of its budget (see `shrink_budget`)
+    int case_index = -1;      // which test case of `run()` failed (see `case_rng()`)
+    std::optional<uint64_t> seed = std::nullopt;// the seed of the run that found it, to rerun with `--seed`
 };
 
 struct CannotGenerateValues {
@@ -23,11 +32,36 @@ struct CannotGenerateValues {
 template<typename T>
 using TestResult = std::variant<Passes, FailsWith<T>, CannotGenerateValues>;
 
+/* All the distinct failures found in a single run, each shrunk on its own.
+   See `run_distinct()`. */
+template<typename T>
+struct FailsWithAll {
+    std::vector<FailsWith<T>> failures;
+};
+
+template<typename T>
+using DistinctTestResult = std::variant<Passes, FailsWithAll<T>, CannotGenerateValues>;
+
+template<typename T>
+std::string failure_to_string(const FailsWith<T> &f) {
+    using std::to_string;// non-numeric values can provide their own to_string
+    std::string str = "Fails:\n - value: " + to_string(f.value) + "\n - error: \"" + f.error + "\"";
+    if (!f.fully_shrunk) {
+        std::ostringstream run;
+        run << f.run;
+        str += "\n - not fully shrunk (ran out of shrink budget), resume from: " + run.str();
+    }
+    if (f.seed) {
+        str += "\n - found at case #" + std::to_string(f.case_index) + ", rerun with: --seed " + std::to_string(*f.seed);
+    }
+    return str;
+}
+
 template<typename T>
 std::string to_string(const TestResult<T> &result) {
     struct stringifier {
         std::string operator()(Passes) { return "Passes"; }
-        std::string operator()(FailsWith<T> f) { return "Fails:\n - value: " + std::to_string(f.value) + "\n - error: \"" + f.error + "\""; }
+        std::string operator()(const FailsWith<T> &f) { return failure_to_string(f); }
         std::string operator()(const CannotGenerateValues &cgv) {
 
             // Sort the map (well, a vector of pairs)
@@ -48,4 +82,19 @@ std::string to_string(const TestResult<T> &result) {
     return std::visit(stringifier{}, result);
 }
 
+template<typename T>
+std::string to_string(const DistinctTestResult<T> &result) {
+    if (auto all = std::get_if<FailsWithAll<T>>(&result)) {
+        std::string failures = "Fails in " + std::to_string(all->failures.size()) + " distinct ways:";
+        for (const auto &f: all->failures) {
+            failures += "\n" + failure_to_string(f);
+        }
+        return failures;
+    }
+    if (auto cgv = std::get_if<CannotGenerateValues>(&result)) {
+        return to_string(TestResult<T>{*cgv});
+    }
+    return to_string(TestResult<T>{Passes()});
+}
+
 #endif//PBT_TEST_RESULT_H